@@ -0,0 +1,77 @@
+/*
+ * Measures the construction of the argv of a command from the format of its
+ * target, as done for each target on each build (to hash the command, then to
+ * run it).
+ *
+ *     cc -O2 -o command command.c && ./command [nb_sources...]
+ *
+ * The targets have 10, 1000 and 10000 sources by default. Each line reports,
+ * for a number of sources and a format, the time in microseconds to build the
+ * command, the best of three rounds, and that time per argument in
+ * nanoseconds.
+ */
+#define CBUILD_IMPLEMENTATION
+#include "../cbuild.h"
+
+static cbuild_target *make_target(int nb_sources, const char *format)
+{
+    cbuild_target *target = calloc(1, sizeof(cbuild_target)
+                                   + (nb_sources + 1) * sizeof(cbuild_source));
+    target->target_file = "build/objects/target.o";
+    target->depfile = "build/objects/target.d";
+    target->command_format = (char *)format;
+    for (int i = 0; i < nb_sources; i++)
+    {
+        char *file = malloc(32);
+        sprintf(file, "src/module/file%d.c", i);
+        target->sources[i].source.file = file;
+        target->sources[i].source_type = CBUILD_FILE_SOURCE;
+        target->sources[i].add_to_command = 1;
+    }
+    cbuild_str_vector_add_strs(&target->command, "-DNAME=\"a b\"", "-O2");
+    return target;
+}
+
+static void measure(int nb_sources, const char *format)
+{
+    cbuild_target *target = make_target(nb_sources, format);
+    // about a million arguments per round
+    int nb_iterations = 1000000 / (nb_sources + 10) + 1;
+    size_t nb_args = cbuild_target_build_command(target).argv.size - 1;
+    double best = 0;
+    for (int round = 0; round < 3; round++)
+    {
+        double start = cbuild_get_time();
+        for (int i = 0; i < nb_iterations; i++)
+        {
+            cbuild_command command = cbuild_target_build_command(target);
+            if (command.argv.strs[nb_args] != NULL)
+                exit(1);
+            cbuild_arena_reset(&cbuild_build_arena);
+        }
+        double elapsed = (cbuild_get_time() - start) / nb_iterations;
+        if (round == 0 || elapsed < best)
+            best = elapsed;
+    }
+    printf("command sources=%d args=%zu format=\"%s\" us=%.2f "
+           "ns_per_arg=%.1f\n", nb_sources, nb_args, format, best * 1e6,
+           best * 1e9 / nb_args);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *formats[] = {
+        "cc -O2 -Wall -Wextra -o %t %s",
+        "cc -MMD -MF %d -c -o %t %a %s",
+    };
+    const char *default_sizes[] = { "10", "1000", "10000" };
+    const char **sizes = argc > 1 ? (const char **)argv + 1 : default_sizes;
+    int nb_sizes = argc > 1 ? argc - 1 : 3;
+
+    for (int i = 0; i < nb_sizes; i++)
+    {
+        for (size_t j = 0; j < sizeof(formats) / sizeof(*formats); j++)
+            measure(atoi(sizes[i]), formats[j]);
+    }
+    return 0;
+}
@@ -0,0 +1,328 @@
+/*
+ * Measures the overhead of cbuild itself on synthetic graphs, whose commands
+ * do nothing.
+ *
+ *     cc -O2 -o graph graph.c && ./graph [shape [nb_nodes...]]
+ *
+ * The shapes are `fanin' (one target depending on all the others, each one
+ * depending on a file), `chain' (each target depending on the previous one),
+ * `diamond' (layers of targets, each one depending on two targets of the
+ * previous layer) and `all', the default. The graphs have 1000, 10000 and
+ * 100000 targets by default, and each one is measured in its own process,
+ * in a temporary directory. A `graph' line reports, in milliseconds, the
+ * setup of the graph before the scheduler starts and the best of three
+ * multiprocess builds with all the outputs up to date, then the peak resident
+ * memory of the process. A `jobs' line reports, in microseconds, the time per
+ * target of building 1000 of them with `true' on one process, the time to run
+ * `true' alone, the best of three each, and the difference: the overhead of
+ * cbuild per job.
+ */
+#define CBUILD_IMPLEMENTATION
+#include "../cbuild.h"
+
+#include <sys/resource.h>
+
+static cbuild_target *new_target(int id, size_t nb_sources,
+                                 const char *command_format)
+{
+    size_t size = sizeof(cbuild_target)
+        + (nb_sources + 1) * sizeof(cbuild_source);
+    cbuild_target *target = calloc(1, size);
+    target->target_file = malloc(32);
+    sprintf(target->target_file, "t/%d", id);
+    target->command_format = (char *)command_format;
+    return target;
+}
+
+static void add_file_source(cbuild_target *target, size_t index, int id)
+{
+    target->sources[index].source.file = malloc(32);
+    sprintf(target->sources[index].source.file, "s/%d", id);
+    target->sources[index].source_type = CBUILD_FILE_SOURCE;
+}
+
+static void add_target_source(cbuild_target *target, size_t index,
+                              cbuild_target *source)
+{
+    target->sources[index].source.target = source;
+    target->sources[index].source_type = CBUILD_TARGET_SOURCE;
+}
+
+/*
+ * builds a graph of nb_nodes targets, the last one of targets being the one
+ * to build, and the level of each target: 1 + the highest level of its target
+ * sources, 0 without any
+ */
+static cbuild_target **make_graph(const char *shape, int nb_nodes,
+                                  const char *command_format, int **levels)
+{
+    cbuild_target **targets = calloc(nb_nodes, sizeof(cbuild_target *));
+    *levels = calloc(nb_nodes, sizeof(int));
+    if (strcmp(shape, "fanin") == 0)
+    {
+        for (int i = 0; i < nb_nodes - 1; i++)
+        {
+            targets[i] = new_target(i, 1, command_format);
+            add_file_source(targets[i], 0, i);
+        }
+        targets[nb_nodes - 1] = new_target(nb_nodes - 1, nb_nodes - 1,
+                                           command_format);
+        for (int i = 0; i < nb_nodes - 1; i++)
+            add_target_source(targets[nb_nodes - 1], i, targets[i]);
+        (*levels)[nb_nodes - 1] = 1;
+    }
+    else if (strcmp(shape, "chain") == 0)
+    {
+        targets[0] = new_target(0, 1, command_format);
+        add_file_source(targets[0], 0, 0);
+        for (int i = 1; i < nb_nodes; i++)
+        {
+            targets[i] = new_target(i, 1, command_format);
+            add_target_source(targets[i], 0, targets[i - 1]);
+            (*levels)[i] = i;
+        }
+    }
+    else if (strcmp(shape, "diamond") == 0)
+    {
+        int width = 1;
+        while (width * width < nb_nodes)
+            width++;
+        for (int i = 0; i < nb_nodes - 1; i++)
+        {
+            if (i < width)
+            {
+                targets[i] = new_target(i, 1, command_format);
+                add_file_source(targets[i], 0, i);
+                continue;
+            }
+            // the targets i - width and its neighbour in the previous layer
+            int layer_start = i - i % width - width;
+            int right = layer_start + (i % width + 1) % width;
+            targets[i] = new_target(i, 2, command_format);
+            add_target_source(targets[i], 0, targets[i - width]);
+            add_target_source(targets[i], 1, targets[right]);
+            (*levels)[i] = 1 + (*levels)[i - width];
+        }
+        // the targets no other one depends on are among the last width ones
+        int first = nb_nodes - 1 > width ? nb_nodes - 1 - width : 0;
+        targets[nb_nodes - 1] = new_target(nb_nodes - 1, nb_nodes - 1 - first,
+                                           command_format);
+        for (int i = first; i < nb_nodes - 1; i++)
+        {
+            add_target_source(targets[nb_nodes - 1], i - first, targets[i]);
+            if ((*levels)[i] + 1 > (*levels)[nb_nodes - 1])
+                (*levels)[nb_nodes - 1] = (*levels)[i] + 1;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "unknown shape `%s'\n", shape);
+        exit(1);
+    }
+    return targets;
+}
+
+/*
+ * writes the sources and the outputs of a graph, the outputs being more
+ * recent than their sources so that the graph is up to date
+ */
+static void write_files(cbuild_target **targets, int *levels, int nb_nodes)
+{
+    struct timespec origin;
+    clock_gettime(CLOCK_REALTIME, &origin);
+    origin.tv_sec -= 1000;
+    origin.tv_nsec = 1000;
+    for (int i = 0; i < nb_nodes; i++)
+    {
+        cbuild_target *target = targets[i];
+        for (size_t j = 0; target->sources[j].source_type; j++)
+        {
+            if (target->sources[j].source_type != CBUILD_FILE_SOURCE)
+                continue;
+            close(open(target->sources[j].source.file, O_WRONLY | O_CREAT,
+                       0644));
+            struct timespec times[2] = { origin, origin };
+            utimensat(AT_FDCWD, target->sources[j].source.file, times, 0);
+        }
+        close(open(target->target_file, O_WRONLY | O_CREAT, 0644));
+        // a microsecond per level, the levels staying in the same second
+        struct timespec time = origin;
+        time.tv_nsec += (levels[i] + 1) * 1000L;
+        struct timespec times[2] = { time, time };
+        utimensat(AT_FDCWD, target->target_file, times, 0);
+    }
+}
+
+/*
+ * sends stdout, where the commands are logged, to /dev/null, then back
+ */
+static int mute(int saved_stdout)
+{
+    fflush(stdout);
+    if (saved_stdout != -1)
+    {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+        return -1;
+    }
+    saved_stdout = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    return saved_stdout;
+}
+
+static void measure_graph(const char *shape, int nb_nodes)
+{
+    int *levels;
+    cbuild_target **targets = make_graph(shape, nb_nodes, "true", &levels);
+    cbuild_target *root = targets[nb_nodes - 1];
+    write_files(targets, levels, nb_nodes);
+
+    double start = cbuild_get_time();
+    cbuild_stat_prefetch(root);
+    cbuild_target_stack stack = { 0 };
+    cbuild_setup_target_stack(root, &stack);
+    cbuild_target_queue ready = { 0 };
+    cbuild_setup_ready_queue(&stack, &ready);
+    double setup = cbuild_get_time() - start;
+
+    double noop = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        int built = 0;
+        int saved_stdout = mute(-1);
+        start = cbuild_get_time();
+        int error = cbuild_multiprocess_build_target(root, &built, 0, 0);
+        double elapsed = cbuild_get_time() - start;
+        mute(saved_stdout);
+        if (error || built)
+        {
+            fprintf(stderr, "%s graph of %d targets not up to date\n", shape,
+                    nb_nodes);
+            exit(1);
+        }
+        if (i == 0 || elapsed < noop)
+            noop = elapsed;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("graph shape=%s nodes=%d setup_ms=%.2f noop_ms=%.2f rss_mib=%.1f\n",
+           shape, nb_nodes, setup * 1e3, noop * 1e3, usage.ru_maxrss / 1024.);
+}
+
+static void measure_jobs(const char *shape, int nb_nodes)
+{
+    int *levels;
+    cbuild_target **targets = make_graph(shape, nb_nodes, "true", &levels);
+    write_files(targets, levels, nb_nodes);
+    cbuild_command command = { 0 };
+    cbuild_command_add_args(&command, "true");
+
+    // the best of three, spawning processes being noisy
+    double build = 0;
+    double spawn = 0;
+    int error = 0;
+    int saved_stdout = mute(-1);
+    for (int i = 0; i < 3 && !error; i++)
+    {
+        double start = cbuild_get_time();
+        error = cbuild_multiprocess_build_target(targets[nb_nodes - 1], NULL,
+                                                 1, 1);
+        double elapsed = cbuild_get_time() - start;
+        if (i == 0 || elapsed < build)
+            build = elapsed;
+
+        start = cbuild_get_time();
+        for (int j = 0; j < nb_nodes && !error; j++)
+            error = pid_wait(cbuild_command_exec_async(&command)) != 0;
+        elapsed = cbuild_get_time() - start;
+        if (i == 0 || elapsed < spawn)
+            spawn = elapsed;
+    }
+    mute(saved_stdout);
+    if (error)
+    {
+        fprintf(stderr, "could not run `true'\n");
+        exit(1);
+    }
+
+    double job_us = build / nb_nodes * 1e6;
+    double spawn_us = spawn / nb_nodes * 1e6;
+    printf("jobs shape=%s nodes=%d job_us=%.1f spawn_us=%.1f "
+           "overhead_us=%.1f\n", shape, nb_nodes, job_us, spawn_us,
+           job_us - spawn_us);
+}
+
+static void remove_tree(const char *path)
+{
+    DIR *dir = opendir(path);
+    struct dirent *ent;
+    while (dir != NULL && (ent = readdir(dir)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        char *file = malloc(strlen(path) + strlen(ent->d_name) + 2);
+        sprintf(file, "%s/%s", path, ent->d_name);
+        if (ent->d_type == DT_DIR)
+            remove_tree(file);
+        else
+            remove(file);
+        free(file);
+    }
+    if (dir != NULL)
+        closedir(dir);
+    rmdir(path);
+}
+
+/*
+ * runs a measure in a child process, in a temporary directory, so that each
+ * one starts with the same state and has its own peak memory
+ */
+static int run(void (*measure)(const char *, int), const char *shape,
+               int nb_nodes)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        char dir[] = "/tmp/cbuild-graph-XXXXXX";
+        if (mkdtemp(dir) == NULL || chdir(dir) == -1
+                || mkdir("s", 0755) == -1 || mkdir("t", 0755) == -1)
+        {
+            fprintf(stderr, "could not create %s\n", dir);
+            _exit(1);
+        }
+        cbuild_usage_summary_size = 0;
+        measure(shape, nb_nodes);
+        fflush(stdout);
+        remove_tree(dir);
+        _exit(0);
+    }
+    return pid == -1 || pid_wait(pid) != 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *all_shapes[] = { "fanin", "chain", "diamond" };
+    const char **shapes = all_shapes;
+    int nb_shapes = 3;
+    if (argc > 1 && strcmp(argv[1], "all") != 0)
+    {
+        shapes = (const char **)argv + 1;
+        nb_shapes = 1;
+    }
+    const char *default_sizes[] = { "1000", "10000", "100000" };
+    const char **sizes = argc > 2 ? (const char **)argv + 2 : default_sizes;
+    int nb_sizes = argc > 2 ? argc - 2 : 3;
+
+    int error = 0;
+    for (int i = 0; i < nb_shapes; i++)
+    {
+        for (int j = 0; j < nb_sizes; j++)
+            error |= run(measure_graph, shapes[i], atoi(sizes[j]));
+        error |= run(measure_jobs, shapes[i], 1000);
+    }
+    return error;
+}
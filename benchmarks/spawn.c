@@ -0,0 +1,85 @@
+/*
+ * Measures the latency of starting a command as the memory of the parent
+ * grows, with the launcher of cbuild and with fork and execvp.
+ *
+ *     cc -O2 -o spawn spawn.c && ./spawn [nb_spawns [size_mib...]]
+ *
+ * Each line reports, for a parent resident size, the average time in
+ * microseconds between starting `true' and reaping it.
+ */
+#define CBUILD_IMPLEMENTATION
+#include "../cbuild.h"
+
+static pid_t fork_exec(cbuild_command *command)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execvp(command->argv.strs[0], command->argv.strs);
+        _exit(127);
+    }
+    return pid;
+}
+
+static double measure(cbuild_command *command, int nb_spawns, int use_fork)
+{
+    // the launcher logs every command
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    double start = cbuild_get_time();
+    for (int i = 0; i < nb_spawns; i++)
+    {
+        pid_t pid = use_fork ? fork_exec(command)
+                             : cbuild_command_exec_async(command);
+        if (pid == -1 || pid_wait(pid) != 0)
+        {
+            fprintf(stderr, "could not run `true'\n");
+            exit(1);
+        }
+    }
+    double elapsed = cbuild_get_time() - start;
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    return elapsed / nb_spawns * 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    int nb_spawns = argc > 1 ? atoi(argv[1]) : 200;
+    const char *default_sizes[] = { "0", "64", "256", "1024" };
+    const char **sizes = argc > 2 ? (const char **)argv + 2 : default_sizes;
+    int nb_sizes = argc > 2 ? argc - 2 : 4;
+
+    cbuild_command command = { 0 };
+    cbuild_command_add_args(&command, "true");
+
+    char *memory = NULL;
+    size_t memory_size = 0;
+    for (int i = 0; i < nb_sizes; i++)
+    {
+        size_t size = strtoull(sizes[i], NULL, 10) << 20;
+        if (size > memory_size)
+        {
+            memory = realloc(memory, size);
+            if (memory == NULL)
+            {
+                fprintf(stderr, "could not allocate %s MiB\n", sizes[i]);
+                return 1;
+            }
+            // touches the pages so that they are resident
+            memset(memory + memory_size, 1, size - memory_size);
+            memory_size = size;
+        }
+        printf("rss_mib=%s spawns=%d cbuild_us=%.1f fork_us=%.1f\n", sizes[i],
+               nb_spawns, measure(&command, nb_spawns, 0),
+               measure(&command, nb_spawns, 1));
+    }
+    free(memory);
+    return 0;
+}
@@ -1,10 +1,62 @@
 #ifndef CBUILD_H
 #define CBUILD_H
 
+// only effective if no libc header was included before, the command
+// rebuilding cbuild defines it as well
+#if defined(CBUILD_IMPLEMENTATION) && !defined(_GNU_SOURCE)
+#  define _GNU_SOURCE
+#endif
+
 #include <time.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+
+/**
+ * @brief arena allocator: the memory is taken from large blocks and given back
+ * all at once, by cbuild_arena_reset which keeps the blocks to be used again,
+ * or by cbuild_arena_release which frees them
+ */
+typedef struct {
+    struct cbuild_arena_block *first; ///< first block, NULL if none
+    struct cbuild_arena_block *current; ///< block allocated from
+} cbuild_arena;
+
+/**
+ * @brief arena of the allocations made during a build: expanded commands and
+ * the graph given to the scheduler. It is reset at the end of each build, so
+ * what comes from it must not be kept after that
+ */
+extern cbuild_arena cbuild_build_arena;
+
+/**
+ * @brief allocates memory from an arena, aligned for any type
+ * @param arena the arena
+ * @param size the size of the allocation
+ */
+void *cbuild_arena_alloc(cbuild_arena *arena, size_t size);
+/**
+ * @brief resizes an allocation of an arena, in place if nothing was allocated
+ * after it, otherwise by copying it to a new one
+ * @param arena the arena
+ * @param ptr the allocation, or the end of one, or NULL
+ * @param old_size its size
+ * @param size its new size
+ */
+void *cbuild_arena_realloc(cbuild_arena *arena, void *ptr, size_t old_size,
+        size_t size);
+/**
+ * @brief gives back every allocation of an arena at once, the blocks being kept
+ * for the next allocations so that repeated builds use the same memory
+ * @param arena the arena
+ */
+void cbuild_arena_reset(cbuild_arena *arena);
+/**
+ * @brief frees the blocks of an arena
+ * @param arena the arena
+ */
+void cbuild_arena_release(cbuild_arena *arena);
 
 /**
  * @brief String Builder implementation
@@ -13,6 +65,7 @@ typedef struct {
   char *str; ///< the string being built
   size_t size; ///< number of character in the string
   size_t capacity; ///< total capacity of str
+  cbuild_arena *arena; ///< if not NULL, the arena str is allocated from
 } cbuild_str_builder;
 
 /**
@@ -27,6 +80,14 @@ void cbuild_str_builder_append_char(cbuild_str_builder *str, char c);
  * @param cstr the cstring
  */
 void cbuild_str_builder_append_cstr(cbuild_str_builder *str, char *cstr);
+/**
+ * @brief append a buffer to the string builder
+ * @param sb the string builder
+ * @param data the buffer
+ * @param size the size of the buffer
+ */
+void cbuild_str_builder_append_data(cbuild_str_builder *str, const char *data,
+        size_t size);
 /**
  * @brief create a string builder from a cstring
  * @param str the cstring
@@ -49,6 +110,7 @@ typedef struct {
     char **strs; ///< array of strings
     size_t size; ///< number of strings in the array
     size_t capacity; ///< total capacity of the array
+    cbuild_arena *arena; ///< if not NULL, the arena strs is allocated from
 } cbuild_str_vector;
 
 /**
@@ -147,6 +209,227 @@ typedef struct {
         .add_to_command = 1                                                    \
     }
 
+/**
+ * @brief hash map using strings as keys, the keys are not copied
+ */
+typedef struct {
+    const char **keys; ///< array of keys, NULL for the empty slots
+    void **values; ///< values associated to the keys
+    size_t size; ///< number of elements in the map
+    size_t capacity; ///< number of slots, always a power of 2
+} cbuild_hash_map;
+
+/**
+ * @brief returns the value associated to a key, NULL if there is none
+ * @param map the map
+ * @param key the key
+ */
+void *cbuild_hash_map_get(cbuild_hash_map *map, const char *key);
+/**
+ * @brief associates a value to a key, replacing the previous one
+ * @param map the map
+ * @param key the key, must live as long as the map
+ * @param value the value
+ */
+void cbuild_hash_map_set(cbuild_hash_map *map, const char *key, void *value);
+
+/**
+ * @brief what is remembered about a target from one build to the other, saved
+ * in the cbuild_state_dir directory
+ */
+typedef struct {
+    char *target_file; ///< file generated by the target
+    double duration; ///< wall time of its last build in seconds, 0 if unknown
+    unsigned long long inputs_hash; ///< hash of the sources of its last build
+    unsigned long long command_hash; ///< hash of the command of its last build
+    unsigned long long output_hash; ///< hash of its output, for early cutoff
+    long long output_mtime; ///< modification time in nanoseconds of the output when its content last changed
+    double user_time; ///< user CPU time in seconds of its last command
+    double system_time; ///< system CPU time in seconds of its last command
+    long long max_rss; ///< peak resident memory in KiB of its last command, 0 if unknown
+} cbuild_target_record;
+
+/**
+ * @brief directory in which cbuild saves what it knows about previous builds
+ */
+extern const char *cbuild_state_dir;
+
+/**
+ * @brief returns the record of a target file, creating it if needed
+ * @param target_file the file generated by the target
+ */
+cbuild_target_record *cbuild_get_target_record(const char *target_file);
+/**
+ * @brief saves the target records in cbuild_state_dir
+ */
+int cbuild_save_target_records(void);
+
+/**
+ * @brief fingerprint of the content of a file, only computed again when the
+ * size, modification time or inode of the file changed, or when the file was
+ * modified in the tick it was hashed in, where an edit keeps its mtime
+ */
+typedef struct {
+    char *file; ///< the file
+    long long size; ///< size of the file when it was hashed
+    long long mtime; ///< modification time in nanoseconds of the file when it was hashed
+    unsigned long long inode; ///< inode of the file when it was hashed
+    unsigned long long hash; ///< hash of the content of the file
+    long long taken; ///< time in nanoseconds it was hashed at, on the clock of the file timestamps
+} cbuild_file_fingerprint;
+
+/**
+ * @brief if set to != 0, targets are rebuilt only when the content of their
+ * sources changed since their last build, instead of comparing modification
+ * times. The fingerprints are saved in cbuild_state_dir
+ */
+extern int cbuild_use_content_hash;
+
+/**
+ * @brief if set to != 0, a rebuilt target whose output is identical to the
+ * previous one does not make the targets depending on it out of date. This is
+ * always the case with cbuild_use_content_hash
+ */
+extern int cbuild_early_cutoff;
+
+/**
+ * @brief returns the hash of the content of a file, 0 if it cannot be read
+ * @param file the file
+ */
+unsigned long long cbuild_get_file_hash(const char *file);
+/**
+ * @brief saves the file fingerprints in cbuild_state_dir
+ */
+int cbuild_save_fingerprints(void);
+
+/**
+ * @brief directory of the cache of target outputs, shared by the builds of
+ * all the projects of the host. If NULL, the CBUILD_CACHE_DIR environment
+ * variable is used, and the cache is disabled if it is not set either
+ *
+ * @details an entry is keyed by the expanded command of a target and the
+ * content of its sources (headers found in depfiles included), and contains
+ * its output and what the command printed. Only the targets with a depfile
+ * are cached: the headers the others include are not known, so that an
+ * entry could be restored after one of them changed
+ */
+extern const char *cbuild_cache_dir;
+/**
+ * @brief size in bytes above which the least recently used cache entries are
+ * removed
+ */
+extern unsigned long long cbuild_cache_max_size;
+/**
+ * @brief directory of a cache shared by several hosts, on a network mount for
+ * instance. If NULL, the CBUILD_REMOTE_CACHE_DIR environment variable is used
+ *
+ * @details it uses the keys of the local cache, its entries being fetched in
+ * it, and cbuild_cache_dir defaults to the `cache' directory of
+ * cbuild_state_dir when it is enabled
+ */
+extern const char *cbuild_remote_cache_dir;
+/**
+ * @brief number of threads fetching the entries of the targets about to be
+ * built and storing the new ones in the remote cache
+ */
+extern unsigned cbuild_remote_cache_jobs;
+
+/**
+ * @brief copies a file, sharing its blocks with the copy when the filesystem
+ * supports it. The copy is written next to the destination and renamed
+ * @param source the file to copy
+ * @param destination the copy
+ */
+int cbuild_copy_file(const char *source, const char *destination);
+
+/**
+ * @brief returns the time in seconds from an arbitrary point, for durations
+ */
+double cbuild_get_time(void);
+
+/**
+ * @brief dynamic target vector
+ */
+typedef struct
+{
+    struct cbuild_target **targets; ///< array of targets
+    size_t size; ///< number of targets in the array
+    size_t capacity; ///< total capacity of the array
+} cbuild_target_vector;
+
+/**
+ * @brief adds a target to a vector
+ * @param vector the vector
+ * @param target the target
+ */
+void cbuild_target_vector_add_target(cbuild_target_vector *vector,
+        struct cbuild_target *target);
+
+/**
+ * @brief scheduling state of a target during a multiprocess build
+ */
+enum cbuild_target_state {
+    CBUILD_TARGET_IDLE, ///< not part of the current build (yet)
+    CBUILD_TARGET_WAITING, ///< waiting for some target sources to be built
+    CBUILD_TARGET_READY, ///< all target sources are built, queued
+    CBUILD_TARGET_RUNNING, ///< being built
+    CBUILD_TARGET_DONE, ///< built or up to date
+    CBUILD_TARGET_FAILED, ///< its command failed
+};
+
+/**
+ * @brief first reason why a target is rebuilt, see cbuild_explain
+ */
+typedef struct {
+    enum {
+        CBUILD_CAUSE_NONE, ///< up to date
+        CBUILD_CAUSE_ALWAYS_RECOMPILE, ///< every target is rebuilt
+        CBUILD_CAUSE_COMMAND_CHANGED, ///< its command changed
+        CBUILD_CAUSE_UNKNOWN_HEADERS, ///< its depfile was never read
+        CBUILD_CAUSE_MISSING_OUTPUT, ///< its output does not exist
+        CBUILD_CAUSE_NEWER_SOURCE, ///< file is newer than its output
+        CBUILD_CAUSE_MISSING_SOURCE, ///< file, a discovered header, is missing
+        CBUILD_CAUSE_REBUILT_SOURCE, ///< file, a target source, was rebuilt
+        CBUILD_CAUSE_EARLIER_BUILD, ///< a target built before it was rebuilt
+        CBUILD_CAUSE_INPUTS_CHANGED, ///< the content of its sources changed
+    } kind;
+    const char *file; ///< the source involved, if any
+    long long source_mtime; ///< modification time in nanoseconds of file
+    long long target_mtime; ///< modification time in nanoseconds of the output
+} cbuild_rebuild_cause;
+
+/**
+ * @brief piece of a compiled command format
+ */
+typedef struct {
+    enum {
+        CBUILD_TOKEN_TEXT, ///< text of the format, part of an argument
+        CBUILD_TOKEN_TARGET, ///< %t, part of an argument
+        CBUILD_TOKEN_DEPFILE, ///< %d, part of an argument
+        CBUILD_TOKEN_SOURCES, ///< %s, an argument per source
+        CBUILD_TOKEN_ARGS, ///< %a, an argument per custom argument
+        CBUILD_TOKEN_SPLIT, ///< end of the current argument, if not empty
+    } kind;
+    const char *text; ///< the text of a CBUILD_TOKEN_TEXT
+    size_t size; ///< size of the text
+} cbuild_command_token;
+
+/**
+ * @brief command format split into tokens once, so that building a command
+ * only copies them, see cbuild_target_build_command
+ */
+typedef struct {
+    char *text; ///< copy of the format, where the text of the tokens is
+    cbuild_command_token *tokens; ///< the tokens
+    size_t size; ///< number of tokens
+} cbuild_command_template;
+
+/**
+ * @brief compiles a command format, see cbuild_target_build_command
+ * @param format the format
+ */
+cbuild_command_template *cbuild_compile_command_format(const char *format);
+
 /**
  * @brief structure to represent a target that can be built
  */
@@ -155,6 +438,23 @@ typedef struct cbuild_target {
     int is_built;
     char *command_format;
     cbuild_str_vector command; ///< first part of the command to execute to build the target
+    cbuild_command_template *command_template; ///< command_format compiled
+    char *depfile; ///< makefile listing the headers of the target, as written by `-MMD -MF`
+    unsigned visit_generation; ///< last graph traversal that reached it
+    enum cbuild_target_state state; ///< state in the multiprocess scheduler
+    size_t pending_sources; ///< number of target sources not built yet
+    cbuild_target_vector dependents; ///< targets having this one as a source
+    cbuild_target_record *record; ///< what is known from the previous builds
+    unsigned long long inputs_hash; ///< hash of the sources of the current build
+    unsigned long long command_hash; ///< hash of the command of the current build
+    int changed; ///< rebuilt during the current build, with a new output
+    int stale; ///< result of the check of the multiprocess build, -1 before it
+    unsigned long long cache_key; ///< key of the target in the cache, 0 if none
+    char *cache_entry; ///< entry being filled by the running build, if any
+    double start_time; ///< when the build of the target started
+    double priority; ///< duration of the longest path to the built target
+    struct cbuild_pool *pool; ///< pool the target is built in, NULL if none
+    cbuild_rebuild_cause cause; ///< why it is rebuilt in the current build
     cbuild_source sources[]; ///< sources required by the target
 } cbuild_target;
 
@@ -166,6 +466,10 @@ typedef struct cbuild_target {
  *          %t: the target file
  *          %a: all the custom arguments (you must use this if you want to have
  *              arguments with spaces)
+ *          %d: the depfile of the target
+ *          The format is compiled on the first call, and again when
+ *          command_format changes. The arguments and argv are allocated at
+ *          once from cbuild_build_arena, empty arguments being left out
  * //TODO: %s[n] and %a[n] to specify the number of the source or argument
  */
 cbuild_command cbuild_target_build_command(cbuild_target *target);
@@ -193,6 +497,77 @@ cbuild_command cbuild_target_build_command(cbuild_target *target);
         }                                                                      \
     }
 
+/**
+ * @brief initializer for a target whose headers are discovered by the
+ * compiler: the depfile is read after each successful build, and the headers
+ * it lists are checked along with the sources on the next builds
+ * @param FILENAME name of the file associated to the target
+ * @param DEPFILE name of the depfile written by the command
+ * @param __VA_ARGS__ all the different sources,
+ *        see CBUILD_MAKE_(FILE|TARGET)_SOURCE
+ *
+ * @code
+ * static cbuild_target target = CBUILD_TARGET_WITH_DEPFILE("elf.o", "elf.d",
+ *         "cc -MMD -MF %d -c -o %t %s",
+ *         CBUILD_MAKE_FILE_SOURCE("elf.c")
+ *     )
+ * @endcode
+ */
+#define CBUILD_TARGET_WITH_DEPFILE(FILENAME, DEPFILE, FORMAT, ...)             \
+    {                                                                          \
+        .target_file = FILENAME,                                               \
+        .command_format = FORMAT,                                              \
+        .depfile = DEPFILE,                                                    \
+        .sources = {                                                           \
+            __VA_ARGS__ __VA_OPT__(,)                                          \
+            { .source_type = CBUILD_NONE }                                     \
+        }                                                                      \
+    }
+
+/**
+ * @brief initializer for a target built in a pool, see cbuild_pool. The pool
+ * of a target created with another initializer can be set afterwards
+ * @param FILENAME name of the file associated to the target
+ * @param POOL pointer to the pool
+ * @param __VA_ARGS__ all the different sources,
+ *        see CBUILD_MAKE_(FILE|TARGET)_SOURCE
+ */
+#define CBUILD_TARGET_IN_POOL(FILENAME, POOL, FORMAT, ...)                     \
+    {                                                                          \
+        .target_file = FILENAME,                                               \
+        .command_format = FORMAT,                                              \
+        .pool = POOL,                                                          \
+        .sources = {                                                           \
+            __VA_ARGS__ __VA_OPT__(,)                                          \
+            { .source_type = CBUILD_NONE }                                     \
+        }                                                                      \
+    }
+
+/**
+ * @brief reads a depfile and adds the files the target depends on to a vector.
+ * The added strings belong to cbuild and are shared between the targets
+ *
+ * @param depfile the depfile, makefile syntax
+ * @param deps the vector
+ */
+int cbuild_parse_depfile(const char *depfile, cbuild_str_vector *deps);
+/**
+ * @brief returns the files discovered in the depfile of a target during its
+ * last successful build, NULL if there are none
+ *
+ * @param target_file the file generated by the target
+ */
+cbuild_str_vector *cbuild_get_discovered_deps(const char *target_file);
+/**
+ * @brief records the discovered dependencies of a target in the deps log of
+ * cbuild_state_dir
+ *
+ * @param target_file the file generated by the target
+ * @param deps the dependencies, see cbuild_parse_depfile
+ */
+int cbuild_record_discovered_deps(const char *target_file,
+        cbuild_str_vector *deps);
+
 /**
  * @brief returns true if the source file has had more recent modifications that
  * the target file
@@ -202,6 +577,15 @@ cbuild_command cbuild_target_build_command(cbuild_target *target);
  */
 int cbuild_target_is_older_than_source(const char *target, const char *source);
 
+/**
+ * @brief returns true if a target is out of date, either compared to the
+ * modification time or to the content of its sources, see
+ * cbuild_use_content_hash, or if its command changed since its last build
+ *
+ * @param target the target
+ */
+int cbuild_target_needs_rebuild(struct cbuild_target *target);
+
 /**
  * @brief checks if a file exists
  *
@@ -209,6 +593,46 @@ int cbuild_target_is_older_than_source(const char *target, const char *source);
  */
 int cbuild_file_exists(const char *file);
 
+/**
+ * @brief stat(2) through the metadata cache of the build: each file is stated
+ * once per build, the outputs of the targets being refreshed when they are
+ * built. Out of the builds, the files are stated directly. Returns 0 on
+ * success and -1 if the file cannot be stated
+ *
+ * @param file the file
+ * @param st the metadata of the file
+ */
+int cbuild_stat(const char *file, struct stat *st);
+/**
+ * @brief forgets the cached metadata of a file, to call when a file is
+ * modified during a build other than as the output of a target
+ *
+ * @param file the file
+ */
+void cbuild_stat_invalidate(const char *file);
+/**
+ * @brief number of threads stating the sources, the discovered headers and the
+ * outputs of the targets before a build starts, 0 to state them when needed.
+ * Small graphs are stated by a single thread
+ */
+extern unsigned cbuild_stat_prefetch_jobs;
+/**
+ * @brief returns the modification time of a file in nanoseconds
+ *
+ * @param st the metadata of the file, see cbuild_stat
+ */
+long long cbuild_stat_mtime(const struct stat *st);
+/**
+ * @brief returns true if a modification time is more recent than a reference.
+ * When both are the same whole second, the filesystem most likely only has
+ * coarse timestamps, and a modification made in the same second as the
+ * reference cannot be told apart from one made before: it counts as more recent
+ *
+ * @param mtime the modification time in nanoseconds
+ * @param reference the reference in nanoseconds
+ */
+int cbuild_mtime_is_newer(long long mtime, long long reference);
+
 /**
  * @brief builds a target synchronously
  *
@@ -229,11 +653,116 @@ int cbuild_build_target(cbuild_target *target, int *built,
  *        has been built
  * @param always_recompile if set to != 0, the target and its dependencies will
  *        always be rebuilt
- * @param nb_process the maximum number of processes that can run simultaneously
+ * @param nb_process the maximum number of processes that can run
+ *        simultaneously, 0 for the number of CPUs cbuild can use, see
+ *        cbuild_available_cpus
  */
 int cbuild_multiprocess_build_target(cbuild_target *target, int *built,
         int always_recompile, unsigned nb_process);
 
+/**
+ * @brief whether a build goes on after a failure, building all the targets
+ * which do not depend on it (`-k' with cargparse). Otherwise, the running
+ * commands are stopped at the first failure. The failures are listed at the
+ * end of the build in both cases
+ */
+extern int cbuild_keep_going;
+
+/**
+ * @brief returns the number of CPUs cbuild can use: the ones of its affinity
+ * mask, fewer if the cgroup v2 CPU quota (cpu.max) of its container is lower
+ */
+unsigned cbuild_available_cpus(void);
+
+/**
+ * @brief type of the `-j' argument of cbuild, a number of processes or `auto'
+ * for the number of CPUs cbuild can use, represented by 0
+ */
+typedef int cbuild_jobs;
+
+/**
+ * @brief whether the multiprocess build shares its processes with make, set
+ * by default. It joins the jobserver of the make running it, found in
+ * MAKEFLAGS, or exports its own to the commands it runs
+ */
+extern int cbuild_use_jobserver;
+
+/**
+ * @brief 1-minute load average above which the multiprocess build does not
+ * start new jobs, until it drops. 0, the default, to ignore the load
+ */
+extern double cbuild_max_load;
+/**
+ * @brief memory pressure, the percentage of time some processes waited for
+ * memory over the last 10 seconds (see /proc/pressure/memory), above which the
+ * multiprocess build does not start new jobs. 0, the default, to ignore it
+ */
+extern double cbuild_max_memory_pressure;
+/**
+ * @brief available memory in MiB (see /proc/meminfo) under which the
+ * multiprocess build does not start new jobs. 0, the default, to ignore it
+ */
+extern unsigned long long cbuild_min_available_memory;
+/**
+ * @brief time in seconds the last multiprocess build did not start jobs because
+ * of cbuild_max_load, cbuild_max_memory_pressure or cbuild_min_available_memory.
+ * One job always runs, whatever the load of the host
+ */
+extern double cbuild_throttled_time;
+
+/**
+ * @brief builds a target, then builds it again each time one of its sources or
+ * of the headers discovered in its depfiles is modified, until cbuild is
+ * interrupted (`--watch' with cargparse). The graph and the metadata of the
+ * files stay in memory, only the modified files are stated again
+ *
+ * @param target the target to build
+ * @param always_recompile if set to != 0, the first build rebuilds the target
+ *        and its dependencies
+ * @param nb_process the maximum number of processes that can run
+ *        simultaneously, 0 for the number of CPUs cbuild can use
+ */
+int cbuild_watch_target(cbuild_target *target, int always_recompile,
+        unsigned nb_process);
+/**
+ * @brief time in milliseconds without modifications after which the watch mode
+ * starts a build, so that a burst of saves triggers a single one
+ */
+extern unsigned cbuild_watch_debounce_ms;
+
+/**
+ * @brief file in which the builds write a Chrome trace (trace event format),
+ * to open in Perfetto or chrome://tracing. If NULL, the `--trace' argument of
+ * cargparse or the CBUILD_TRACE environment variable is used, and no trace is
+ * written if none is set
+ *
+ * @details each job is a span on the track of its slot, with its command and
+ * its exit status, and the scheduler track shows the setup of the graph, the
+ * staleness checks and when slots were left idle
+ */
+extern const char *cbuild_trace_file;
+
+/**
+ * @brief number of targets listed at the end of a build among the ones whose
+ * commands used the most CPU time, and among the ones which used the most
+ * memory, 0 not to list them. The CPU times, the peak resident memory and the
+ * wall time of the commands are kept in the target records, and the lists
+ * compare them to the previous builds
+ */
+extern unsigned cbuild_usage_summary_size;
+
+/**
+ * @brief if set to != 0 (`--explain' with cargparse), the build prints why
+ * each target is rebuilt, see cbuild_rebuild_cause
+ */
+extern int cbuild_explain;
+/**
+ * @brief file in which the builds write why each target is rebuilt as a JSON
+ * array. If NULL, the CBUILD_EXPLAIN_FILE environment variable is used, and
+ * nothing is written if it is not set either
+ */
+extern const char *cbuild_explain_file;
+
 /**
  * @brief removes the target all the files it depends on
  *
@@ -251,16 +780,18 @@ typedef struct cbuild_target_stack_item
 } cbuild_target_stack_item;
 
 /**
- * @brief stack of targets, used to build a target using multiple processes. The
- * process at the top will have the most priority if it can be built.
+ * @brief stack of targets, used to build a target using multiple processes. It
+ * holds every target of the graph once, the built target being at the top.
  */
 typedef struct
 {
     cbuild_target_stack_item *head;
+    cbuild_arena *arena; ///< if not NULL, the arena items are allocated from
 } cbuild_target_stack;
 
 /**
- * @brief pushes a target on a target stack
+ * @brief pushes a target on a target stack, the item being allocated from its
+ * arena if it has one
  *
  * @param sk the stack
  * @param target the target
@@ -268,50 +799,119 @@ typedef struct
 void cbuild_target_stack_push(cbuild_target_stack *sk, cbuild_target *target);
 
 /**
- * @brief stack item containing a target and its associated building process pid
+ * @brief priority queue of targets ready to be built, i.e. whose target sources
+ * have all been built. The targets on the longest path to the built target
+ * come out first, see cbuild_target.priority
  */
 typedef struct
 {
-    pid_t pid; ///< pid of the process building the target
-    cbuild_target *target; ///< the target
-} cbuild_target_map_item;
+    cbuild_target **targets; ///< binary heap of targets
+    size_t size; ///< number of targets in the heap
+    size_t capacity; ///< total capacity of the array
+} cbuild_target_queue;
 
-typedef struct
-{
-    cbuild_target_map_item *items; ///< array of items
-    size_t size; ///< number of elements in the map
-    size_t capacity; ///< maximum number of element in the map
-} cbuild_target_map;
+/**
+ * @brief pushes a target in a target queue
+ *
+ * @param queue the queue
+ * @param target the target
+ */
+void cbuild_target_queue_push(cbuild_target_queue *queue,
+        cbuild_target *target);
+/**
+ * @brief pops the target with the highest priority of a target queue, NULL if
+ * it is empty
+ *
+ * @param queue the queue
+ */
+cbuild_target *cbuild_target_queue_pop(cbuild_target_queue *queue);
 
 /**
- * @brief initializes a target map
+ * @brief pool limiting how many of its targets the multiprocess build runs at
+ * the same time, such as links which need a lot of memory, while the targets
+ * of the other pools keep filling the other processes
  *
- * @param map pointer to the map to initialize
- * @param capacity maximum number of element in the map
+ * @code
+ * static cbuild_pool link_pool = CBUILD_POOL("link", 4);
+ * static cbuild_target elf = CBUILD_TARGET_IN_POOL("elf", &link_pool,
+ *         "cc -o %t %s",
+ *         CBUILD_MAKE_TARGET_SOURCE(&elf_o)
+ *     );
+ * @endcode
+ */
+typedef struct cbuild_pool
+{
+    const char *name; ///< name of the pool
+    unsigned depth; ///< maximum number of targets built at once, 0 for no limit
+    double cpu_share; ///< if not 0, the depth is this share of the CPUs
+    unsigned running; ///< number of targets of the pool being built
+    cbuild_target_queue delayed; ///< ready targets waiting for the pool
+} cbuild_pool;
+
+/**
+ * @brief initializer for a pool
+ * @param NAME name of the pool
+ * @param DEPTH maximum number of targets of the pool built at once
+ */
+#define CBUILD_POOL(NAME, DEPTH)                                               \
+    {                                                                          \
+        .name = NAME,                                                          \
+        .depth = DEPTH,                                                        \
+    }
+
+/**
+ * @brief initializer for a pool whose depth follows the number of CPUs, see
+ * cbuild_available_cpus
+ * @param NAME name of the pool
+ * @param SHARE share of the CPUs the targets of the pool can use, at least one
+ *        target being built at once
+ */
+#define CBUILD_POOL_SCALED(NAME, SHARE)                                        \
+    {                                                                          \
+        .name = NAME,                                                          \
+        .cpu_share = SHARE,                                                    \
+    }
+
+/**
+ * @brief a process building a target, what it prints being kept until it
+ * finishes so that the outputs of parallel jobs are not interleaved
  */
-void cbuild_target_map_init(cbuild_target_map *map, size_t capacity);
+typedef struct
+{
+    cbuild_target *target; ///< the target being built, NULL if the job is free
+    pid_t pid; ///< pid of the process building the target
+    int pidfd; ///< file descriptor of the process, -1 if it is not supported
+    int out_fd; ///< read end of the pipe of its standard output, -1 if closed
+    int err_fd; ///< read end of the pipe of its standard error, -1 if closed
+    cbuild_str_builder out; ///< what it printed on its standard output
+    cbuild_str_builder err; ///< what it printed on its standard error
+    unsigned slot; ///< index of the job in the multiprocess build, its track in the trace
+    char *command; ///< the command, kept for the trace
+} cbuild_job;
+
 /**
- * @brief inserts a target in map with its associated pid
+ * @brief starts the command building a target, returns 0 on success
  *
- * @param map pointer to the map to initialize
- * @param pid pid of the process building the target
- * @param target the target being built
+ * @param job the job, free
+ * @param target the target to build
  */
-void cbuild_target_map_insert(cbuild_target_map *map, pid_t pid, cbuild_target *target);
+int cbuild_job_start(cbuild_job *job, cbuild_target *target);
 /**
- * @brief removes an item from a map
+ * @brief reads what a job printed on one of its pipes, without blocking. The
+ * pipe is closed once the job closed it
  *
- * @param map the map
- * @param pid the pid of the item to remove
+ * @param job the job
+ * @param fd out_fd or err_fd
  */
-void cbuild_target_map_remove(cbuild_target_map *map, pid_t pid);
+void cbuild_job_read(cbuild_job *job, int fd);
 /**
- * @brief returns a target associated to a pid
+ * @brief waits for the process of a job to exit, prints its output at once and
+ * records the target as built if it succeeded. Returns 0 if it did, the job
+ * being free again
  *
- * @param map the map
- * @param pid the pid associated to the target
+ * @param job the job
  */
-cbuild_target *cbuild_target_map_get(cbuild_target_map *map, pid_t pid);
+int cbuild_job_finish(cbuild_job *job);
 
 /**
  * @brief different levels of logging
@@ -383,9 +983,28 @@ int __cbuild_rebuild_yourself(char *cbuild_source, char *cbuild_target, char *ar
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#  include <sys/ioctl.h>
+#  include <linux/fs.h>
+#endif /* __linux__ */
+
+// only declared by unistd.h with _GNU_SOURCE, which may be defined too late
+extern char **environ;
 
 #define __COUNT_VAARGS(a, b, c, d, e, f, g, h, i, j, k, l, m, ...) m
 #define COUNT_VAARGS(...) \
@@ -396,15 +1015,27 @@ int __cbuild_rebuild_yourself(char *cbuild_source, char *cbuild_target, char *ar
 #define CARGPARSE_IMPLEMENTATION
 #define CARG_LOCATION "cargparse.h.in"
 
+int cargparse_parse_cbuild_jobs_arg(char *arg, void *data);
+
 #ifndef CARGPARSE_HEADER
 #  define CARGPARSE_HEADER "cargparse.h"
 #endif
 #include CARGPARSE_HEADER
 
-#else /* CBUILD_ENABLE_CARGPARSE */
-
-int nb_process;
-
+int cargparse_parse_cbuild_jobs_arg(char *arg, void *data)
+{
+    if (arg != NULL && strcmp(arg, "auto") == 0)
+    {
+        *(cbuild_jobs *)data = 0;
+        return CARGPARSE_NO_ERROR;
+    }
+    return cargparse_parse_int_arg(arg, data);
+}
+
+#else /* CBUILD_ENABLE_CARGPARSE */
+
+cbuild_jobs nb_process;
+
 #endif /* ! CBUILD_ENABLE_CARGPARSE */
 
 
@@ -419,15 +1050,14 @@ unsigned cbuild_bootstrap_step = CBUILD_BOOTSTRAP;
 int cbuild_target_is_older_than_source(const char *target, const char *source)
 {
     struct stat st;
-    if (stat(source, &st) == -1)
+    if (cbuild_stat(source, &st) == -1)
         // TODO PANIC
         return 0;
-    unsigned long source_time = st.st_mtime;
+    long long source_time = cbuild_stat_mtime(&st);
 
-    if (stat(target, &st) == -1)
+    if (cbuild_stat(target, &st) == -1)
         return 1;
-    unsigned long target_time = st.st_mtime;
-    return source_time > target_time;
+    return cbuild_mtime_is_newer(source_time, cbuild_stat_mtime(&st));
 }
 
 int cbuild_file_exists(const char *file)
@@ -446,413 +1076,4296 @@ int cbuild_rename(char *source, char *target)
     return 0;
 }
 
-/*** str_builder impl ***/
+double cbuild_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-void cbuild_str_builder_append_char(cbuild_str_builder *sb, char c)
+/*** hash_map impl ***/
+
+size_t cbuild_hash_str(const char *str)
 {
-    if (sb->str == NULL)
+    size_t hash = 14695981039346656037ULL;
+    for (; *str != '\0'; str++)
     {
-        sb->capacity = 8;
-        sb->str = malloc(sb->capacity * sizeof(char));
-        sb->size = 0;
+        hash ^= (unsigned char)*str;
+        hash *= 1099511628211ULL;
     }
-    if (sb->size == sb->capacity)
+    return hash;
+}
+
+/**
+ * hashes a buffer 8 bytes at a time, FNV-1a style, starting from a previous
+ * hash so that several buffers can be combined
+ */
+unsigned long long cbuild_hash_bytes(unsigned long long hash, const void *data,
+        size_t size)
+{
+    const unsigned char *bytes = data;
+    for (; size >= 8; bytes += 8, size -= 8)
     {
-        sb->capacity *= 2;
-        sb->str = realloc(sb->str, sb->capacity);
+        unsigned long long word;
+        memcpy(&word, bytes, 8);
+        hash = (hash ^ word) * 1099511628211ULL;
+        hash ^= hash >> 29;
     }
-
-    sb->str[sb->size++] = c;
+    for (; size > 0; bytes++, size--)
+        hash = (hash ^ *bytes) * 1099511628211ULL;
+    return hash;
 }
 
-void cbuild_str_builder_append_cstr(cbuild_str_builder *str, char *cstr)
+/**
+ * returns the slot of a key, or the empty slot where it should be inserted
+ */
+size_t cbuild_hash_map_find_slot(cbuild_hash_map *map, const char *key)
 {
-    for (size_t i = 0; cstr[i] != 0; i++)
-        cbuild_str_builder_append_char(str, cstr[i]);
+    size_t i = cbuild_hash_str(key) & (map->capacity - 1);
+    while (map->keys[i] != NULL && strcmp(map->keys[i], key) != 0)
+        i = (i + 1) & (map->capacity - 1);
+    return i;
 }
 
-char *cbuild_str_builder_to_cstr(cbuild_str_builder *str)
+void *cbuild_hash_map_get(cbuild_hash_map *map, const char *key)
 {
-    cbuild_str_builder_append_char(str, '\0');
-    char *res = str->str;
-    str->capacity = 0;
-    str->size = 0;
-    str->str = NULL;
-    return res;
+    if (map->size == 0)
+        return NULL;
+    return map->values[cbuild_hash_map_find_slot(map, key)];
 }
 
-void cbuild_str_vector_add_str(cbuild_str_vector *vector, char *str)
+void cbuild_hash_map_set(cbuild_hash_map *map, const char *key, void *value)
 {
-    if (vector->strs == NULL)
+    if (2 * (map->size + 1) > map->capacity)
     {
-        vector->capacity = 8;
-        vector->strs = malloc(vector->capacity * sizeof(char *));
-        vector->size = 0;
+        cbuild_hash_map old = *map;
+        map->capacity = old.capacity ? old.capacity * 2 : 64;
+        map->keys = calloc(map->capacity, sizeof(char *));
+        map->values = calloc(map->capacity, sizeof(void *));
+        for (size_t i = 0; i < old.capacity; i++)
+        {
+            if (old.keys[i] == NULL)
+                continue;
+            size_t slot = cbuild_hash_map_find_slot(map, old.keys[i]);
+            map->keys[slot] = old.keys[i];
+            map->values[slot] = old.values[i];
+        }
+        free(old.keys);
+        free(old.values);
     }
-    if (vector->size == vector->capacity)
+    size_t slot = cbuild_hash_map_find_slot(map, key);
+    if (map->keys[slot] == NULL)
     {
-        vector->capacity *= 2;
-        vector->strs = realloc(vector->strs, vector->capacity * sizeof(char *));
+        map->keys[slot] = key;
+        map->size += 1;
     }
-    vector->strs[vector->size++] = str;
+    map->values[slot] = value;
 }
 
-void __cbuild_str_vector_add_strs(cbuild_str_vector *vector, char *str, ...)
+/*** stat cache impl ***/
+
+unsigned cbuild_stat_prefetch_jobs = 8;
+
+/**
+ * cached metadata of a file
+ */
+typedef struct {
+    char *file;
+    struct stat st;
+    int error; ///< whether stat failed
+    int valid; ///< whether st and error are up to date
+} cbuild_stat_entry;
+
+static cbuild_hash_map cbuild_stat_cache = { 0 };
+/// kept from one build to the other by the watch mode, which invalidates the
+/// modified files
+static int cbuild_stat_cache_kept = 0;
+/// set during the builds, the files being stated directly out of them
+static int cbuild_stat_cache_used = 0;
+
+/**
+ * returns the entry of a file in the stat cache, adding it if needed
+ */
+cbuild_stat_entry *cbuild_stat_entry_get(const char *file)
 {
-    va_list ap;
-    va_start(ap, str);
-    cbuild_str_vector_add_str(vector, str);
-    while ((str = va_arg(ap, char *)) != NULL)
+    cbuild_stat_entry *entry = cbuild_hash_map_get(&cbuild_stat_cache, file);
+    if (entry == NULL)
     {
-        cbuild_str_vector_add_str(vector, str);
+        entry = calloc(1, sizeof(cbuild_stat_entry));
+        entry->file = strdup(file);
+        cbuild_hash_map_set(&cbuild_stat_cache, entry->file, entry);
     }
+    return entry;
 }
 
-void cbuild_str_vector_pop_back(cbuild_str_vector *vector)
+void cbuild_stat_entry_fill(cbuild_stat_entry *entry)
 {
-    vector->size--;
+    entry->error = stat(entry->file, &entry->st) == -1;
+    entry->valid = 1;
 }
 
-char *cbuild_str_vector_join(cbuild_str_vector *vector, char *sep)
+int cbuild_stat(const char *file, struct stat *st)
 {
-    cbuild_str_builder str_builder = { 0 };
-    cbuild_str_builder_append_cstr(&str_builder, vector->strs[0]);
-    for (size_t i = 1; i < vector->size; i++)
-    {
-        if (vector->strs[i] == NULL)
-            continue;
-        cbuild_str_builder_append_cstr(&str_builder, sep);
-        cbuild_str_builder_append_cstr(&str_builder, vector->strs[i]);
-    }
-    return cbuild_str_builder_to_cstr(&str_builder);
+    if (!cbuild_stat_cache_used)
+        return stat(file, st);
+    cbuild_stat_entry *entry = cbuild_stat_entry_get(file);
+    if (!entry->valid)
+        cbuild_stat_entry_fill(entry);
+    if (entry->error)
+        return -1;
+    *st = entry->st;
+    return 0;
 }
 
-void cbuild_command_add_arg(cbuild_command *command, char *arg)
+long long cbuild_stat_mtime(const struct stat *st)
 {
-    cbuild_str_vector_pop_back(&command->argv);
-    cbuild_str_vector_add_str(&command->argv, arg);
-    cbuild_str_vector_add_str(&command->argv, NULL);
+    return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
 }
 
-void __cbuild_command_add_args(cbuild_command *command, char *arg, ...)
+int cbuild_mtime_is_newer(long long mtime, long long reference)
 {
-    cbuild_str_vector_pop_back(&command->argv);
-    va_list ap;
-    va_start(ap, arg);
-    cbuild_str_vector_add_str(&command->argv, arg);
-    while ((arg = va_arg(ap, char *)) != NULL)
-    {
-        cbuild_str_vector_add_str(&command->argv, arg);
-    }
-    cbuild_str_vector_add_str(&command->argv, NULL);
+    // the rebuilt files get a later timestamp once the second is over
+    if (mtime % 1000000000LL == 0 && reference == mtime)
+        return 1;
+    return mtime > reference;
 }
 
-int pid_wait(pid_t pid)
+void cbuild_stat_invalidate(const char *file)
 {
-    int stat_loc;
-    waitpid(pid, &stat_loc, 0);
-    return WEXITSTATUS(stat_loc);
+    cbuild_stat_entry *entry = cbuild_hash_map_get(&cbuild_stat_cache, file);
+    if (entry != NULL)
+        entry->valid = 0;
 }
 
-int cbuild_command_exec_async(cbuild_command *command)
+/**
+ * states a file again if it is in the cache, returning true if it changed
+ * since it was cached
+ */
+int cbuild_stat_refresh(const char *file)
 {
-    assert(command->argv.size > 1);
+    cbuild_stat_entry *entry = cbuild_hash_map_get(&cbuild_stat_cache, file);
+    if (entry == NULL || !entry->valid)
+        return 0;
+    cbuild_stat_entry old = *entry;
+    cbuild_stat_entry_fill(entry);
+    if (entry->error || old.error)
+        return entry->error != old.error;
+    return cbuild_stat_mtime(&entry->st) != cbuild_stat_mtime(&old.st)
+        || entry->st.st_size != old.st.st_size
+        || entry->st.st_ino != old.st.st_ino;
+}
 
-    pid_t pid = fork();
-    if (pid == 0)
+/**
+ * forgets the metadata of all the files, at the start of each build
+ */
+void cbuild_stat_cache_clear(void)
+{
+    for (size_t i = 0; i < cbuild_stat_cache.capacity; i++)
     {
-        char *command_str = cbuild_str_vector_join(&command->argv, " ");
-        cbuild_log(CBUILD_INFO, "CMD `%s'", command_str);
-        execvp(command->argv.strs[0], command->argv.strs);
-        free(command_str);
-        exit(127);
+        cbuild_stat_entry *entry = cbuild_stat_cache.values[i];
+        if (entry == NULL)
+            continue;
+        free(entry->file);
+        free(entry);
     }
-    return pid;
+    free(cbuild_stat_cache.keys);
+    free(cbuild_stat_cache.values);
+    memset(&cbuild_stat_cache, 0, sizeof(cbuild_stat_cache));
 }
 
-int cbuild_command_exec_sync(cbuild_command *command)
-{
-    pid_t pid = cbuild_command_exec_async(command);
-    if (pid == -1)
-        return -1;
-    return pid_wait(pid);
-}
 
 
+const char *cbuild_state_dir = ".cbuild";
 
-cbuild_command cbuild_target_build_command(cbuild_target *target)
+static cbuild_hash_map cbuild_target_records = { 0 };
+static int cbuild_target_records_loaded = 0;
+
+/**
+ * returns a newly allocated path to a file of the state directory
+ */
+char *cbuild_state_file(const char *name)
 {
-    cbuild_str_builder sb = { 0 };
-    cbuild_command command = { 0 };
-    char *format = target->command_format;
-    while (*format != '\0')
+    char *path = malloc(strlen(cbuild_state_dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", cbuild_state_dir, name);
+    return path;
+}
+
+/**
+ * loads the records saved by the previous builds, one per line:
+ * `<target_file>\t<field>=<value>...`, unknown fields being ignored
+ */
+void cbuild_load_target_records(void)
+{
+    cbuild_target_records_loaded = 1;
+    char *path = cbuild_state_file("targets");
+    FILE *file = fopen(path, "r");
+    free(path);
+    if (file == NULL)
+        return;
+
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, file) != -1)
     {
-        if (*format == '%')
-        {
-            switch (*(format + 1))
-            {
-                case 'a':
-                    if (sb.size != 0)
-                        cbuild_command_add_arg(&command, cbuild_str_builder_to_cstr(&sb));
-                    for (size_t i = 0; target->command.size; i++)
-                        cbuild_command_add_arg(&command, target->command.strs[i]);
-                    format += 1;
-                    break;
-                case 's':
-                    if (sb.size != 0)
-                        cbuild_command_add_arg(&command, cbuild_str_builder_to_cstr(&sb));
-                    for (size_t i = 0; target->sources[i].source_type; i++)
-                    {
-                        if (target->sources[i].add_to_command)
-                            cbuild_command_add_arg(&command,
-                                target->sources[i].source_type == CBUILD_FILE_SOURCE
-                                        ? target->sources[i].source.file
-                                        : target->sources[i].source.target->target_file);
-                    }
-                    format += 1;
-                    break;
-                case 't':
-                    cbuild_str_builder_append_cstr(&sb, target->target_file);
-                    format += 1;
-                    break;
-                default:
-                    cbuild_str_builder_append_char(&sb, *format);
-            }
-        }
-        else if (isspace(*format))
+        line[strcspn(line, "\n")] = '\0';
+        char *fields = strchr(line, '\t');
+        if (fields == NULL)
+            continue;
+        *fields++ = '\0';
+        cbuild_target_record *record = cbuild_get_target_record(line);
+        for (char *field = strtok(fields, "\t"); field != NULL;
+             field = strtok(NULL, "\t"))
         {
-            while (isspace(*(format + 1)))
-                format += 1;
-            cbuild_command_add_arg(&command, cbuild_str_builder_to_cstr(&sb));
+            if (strncmp(field, "duration=", 9) == 0)
+                record->duration = strtod(field + 9, NULL);
+            else if (strncmp(field, "inputs=", 7) == 0)
+                record->inputs_hash = strtoull(field + 7, NULL, 16);
+            else if (strncmp(field, "command=", 8) == 0)
+                record->command_hash = strtoull(field + 8, NULL, 16);
+            else if (strncmp(field, "output=", 7) == 0)
+                record->output_hash = strtoull(field + 7, NULL, 16);
+            else if (strncmp(field, "user=", 5) == 0)
+                record->user_time = strtod(field + 5, NULL);
+            else if (strncmp(field, "system=", 7) == 0)
+                record->system_time = strtod(field + 7, NULL);
+            else if (strncmp(field, "max_rss=", 8) == 0)
+                record->max_rss = strtoll(field + 8, NULL, 10);
+            else if (strncmp(field, "output_mtime_ns=", 16) == 0)
+                record->output_mtime = strtoll(field + 16, NULL, 10);
+            // in seconds, written by the previous versions of cbuild
+            else if (strncmp(field, "output_mtime=", 13) == 0)
+                record->output_mtime = strtoll(field + 13, NULL, 10)
+                                       * 1000000000LL;
         }
-        else
-            cbuild_str_builder_append_char(&sb, *format);
-        format += 1;
     }
-    if (sb.size != 0)
-        cbuild_command_add_arg(&command, cbuild_str_builder_to_cstr(&sb));
-    return command;
+    free(line);
+    fclose(file);
 }
 
-int cbuild_clean_target(cbuild_target *target)
+cbuild_target_record *cbuild_get_target_record(const char *target_file)
 {
-    if (cbuild_file_exists(target->target_file))
-    {
-        cbuild_log(CBUILD_WARN, "Removing `%s'", target->target_file);
-        remove(target->target_file);
-    }
-    for (size_t i = 0; target->sources[i].source_type; i++)
+    if (!cbuild_target_records_loaded)
+        cbuild_load_target_records();
+    cbuild_target_record *record = cbuild_hash_map_get(&cbuild_target_records,
+                                                       target_file);
+    if (record == NULL)
     {
-        if (target->sources[i].source_type == CBUILD_TARGET_SOURCE)
-        {
-            cbuild_clean_target(target->sources[i].source.target);
-        }
+        record = calloc(1, sizeof(cbuild_target_record));
+        record->target_file = strdup(target_file);
+        cbuild_hash_map_set(&cbuild_target_records, record->target_file,
+                            record);
     }
-    return 0;
+    return record;
 }
 
-int cbuild_build_target(cbuild_target *target, int *built, int always_recompile)
+int cbuild_save_target_records(void)
 {
-    int build_needed = always_recompile;
-    int local_built = 0;
-    if (built == NULL)
-        built = &local_built;
-
-    for (size_t i = 0; target->sources[i].source_type; i++)
+    if (mkdir(cbuild_state_dir, 0755) == -1 && errno != EEXIST)
     {
-        if (target->sources[i].source_type == CBUILD_TARGET_SOURCE)
-        {
-            if (!target->sources[i].source.target->is_built && 
-                    cbuild_build_target(target->sources[i].source.target, built,
-                                    always_recompile) != 0)
-                return 1;
-            build_needed |= *built;
-            build_needed |= cbuild_target_is_older_than_source(
-                    target->target_file,
-                    target->sources[i].source.target->target_file);
-        }
-        else
-            build_needed |= cbuild_target_is_older_than_source(
-                    target->target_file,
-                    target->sources[i].source.file);
+        cbuild_log(CBUILD_ERROR, "Could not create %s: %s", cbuild_state_dir,
+                   strerror(errno));
+        return 1;
     }
-
-    if (build_needed || *built)
+    char *path = cbuild_state_file("targets");
+    char *tmp_path = cbuild_state_file("targets.tmp");
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL)
     {
-        cbuild_command build_command = cbuild_target_build_command(target);
-        *built = 1;
-        return cbuild_command_exec_sync(&build_command);
+        cbuild_log(CBUILD_ERROR, "Could not open %s: %s", tmp_path,
+                   strerror(errno));
+        free(path);
+        free(tmp_path);
+        return 1;
     }
-    return 0;
+    for (size_t i = 0; i < cbuild_target_records.capacity; i++)
+    {
+        cbuild_target_record *record = cbuild_target_records.values[i];
+        if (record == NULL)
+            continue;
+        fprintf(file, "%s\tduration=%.6f\tinputs=%016llx\tcommand=%016llx",
+                record->target_file, record->duration, record->inputs_hash,
+                record->command_hash);
+        if (record->output_hash != 0)
+            fprintf(file, "\toutput=%016llx\toutput_mtime_ns=%lld",
+                    record->output_hash, record->output_mtime);
+        if (record->max_rss != 0)
+            fprintf(file, "\tuser=%.6f\tsystem=%.6f\tmax_rss=%lld",
+                    record->user_time, record->system_time, record->max_rss);
+        fprintf(file, "\n");
+    }
+    int error = fclose(file) != 0 || cbuild_rename(tmp_path, path);
+    free(path);
+    free(tmp_path);
+    return error;
 }
 
-int cbuild_build_target_async(cbuild_target *target, int *built,
-                              int always_recompile)
-{
-    int build_needed = always_recompile;
+/*** fingerprints impl ***/
 
-    for (size_t i = 0; target->sources[i].source_type; i++)
+int cbuild_use_content_hash = 0;
+int cbuild_early_cutoff = 0;
+
+static cbuild_hash_map cbuild_fingerprints = { 0 };
+static int cbuild_fingerprints_loaded = 0;
+
+cbuild_file_fingerprint *cbuild_get_fingerprint_entry(const char *file)
+{
+    cbuild_file_fingerprint *fingerprint = cbuild_hash_map_get(
+            &cbuild_fingerprints, file);
+    if (fingerprint == NULL)
     {
-        if (target->sources[i].source_type == CBUILD_TARGET_SOURCE)
-            build_needed |= cbuild_target_is_older_than_source(
-                    target->target_file,
-                    target->sources[i].source.target->target_file);
-        else
-            build_needed |= cbuild_target_is_older_than_source(
-                    target->target_file,
-                    target->sources[i].source.file);
+        fingerprint = calloc(1, sizeof(cbuild_file_fingerprint));
+        fingerprint->file = strdup(file);
+        fingerprint->size = -1;
+        cbuild_hash_map_set(&cbuild_fingerprints, fingerprint->file,
+                            fingerprint);
     }
+    return fingerprint;
+}
 
-    if (build_needed)
+/**
+ * loads the fingerprints saved by the previous builds, one per line:
+ * `<file>\tsize=<size>\tmtime_ns=<mtime>\tinode=<inode>\thash=<hash>`
+ * `\ttaken_ns=<time>`. The fingerprints with a modification time in seconds
+ * (`mtime=`), written by the previous versions of cbuild, are hashed again,
+ * and the ones without the time they were taken at are assumed to be as old
+ * as the file they were saved in
+ */
+void cbuild_load_fingerprints(void)
+{
+    cbuild_fingerprints_loaded = 1;
+    char *path = cbuild_state_file("fingerprints");
+    FILE *file = fopen(path, "r");
+    free(path);
+    if (file == NULL)
+        return;
+    struct stat st;
+    long long saved = fstat(fileno(file), &st) == 0 ? cbuild_stat_mtime(&st)
+                                                    : 0;
+
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, file) != -1)
     {
-        cbuild_command build_command = cbuild_target_build_command(target);
-        *built = 1;
-        return cbuild_command_exec_async(&build_command);
+        line[strcspn(line, "\n")] = '\0';
+        char *fields = strchr(line, '\t');
+        if (fields == NULL)
+            continue;
+        *fields++ = '\0';
+        cbuild_file_fingerprint *fingerprint = cbuild_get_fingerprint_entry(line);
+        fingerprint->taken = saved;
+        for (char *field = strtok(fields, "\t"); field != NULL;
+             field = strtok(NULL, "\t"))
+        {
+            if (strncmp(field, "size=", 5) == 0)
+                fingerprint->size = strtoll(field + 5, NULL, 10);
+            else if (strncmp(field, "mtime_ns=", 9) == 0)
+                fingerprint->mtime = strtoll(field + 9, NULL, 10);
+            else if (strncmp(field, "inode=", 6) == 0)
+                fingerprint->inode = strtoull(field + 6, NULL, 10);
+            else if (strncmp(field, "hash=", 5) == 0)
+                fingerprint->hash = strtoull(field + 5, NULL, 16);
+            else if (strncmp(field, "taken_ns=", 9) == 0)
+                fingerprint->taken = strtoll(field + 9, NULL, 10);
+        }
     }
-    target->is_built = 1;
-    return 0;
+    free(line);
+    fclose(file);
 }
 
-void cbuild_target_stack_push(cbuild_target_stack *sk, cbuild_target *target)
+unsigned long long cbuild_hash_file(const char *file)
 {
-    cbuild_target_stack_item *sti = calloc(1, sizeof(cbuild_target_stack_item));
-    sti->target = target;
-    sti->next = sk->head;
-    sk->head = sti;
+    FILE *f = fopen(file, "rb");
+    if (f == NULL)
+        return 0;
+    unsigned long long hash = 14695981039346656037ULL;
+    char buffer[65536];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        hash = cbuild_hash_bytes(hash, buffer, size);
+    fclose(f);
+    // 0 is kept for the files that cannot be read
+    return hash ? hash : 1;
 }
 
-void cbuild_target_map_init(cbuild_target_map *map, size_t capacity)
+/**
+ * returns the current time in nanoseconds on the clock the kernel takes the
+ * file timestamps from, which lags behind CLOCK_REALTIME by up to a tick
+ */
+long long cbuild_timestamp_clock(void)
 {
-    map->capacity = capacity;
-    map->items = calloc(capacity, sizeof(cbuild_target_map_item));
+    struct timespec ts;
+#ifdef CLOCK_REALTIME_COARSE
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-void cbuild_target_map_insert(cbuild_target_map *map, pid_t pid, cbuild_target *target)
+/**
+ * whether a file may have been modified since its fingerprint was taken
+ * without a change of its modification time, as it is not older than the
+ * fingerprint: the racy entries of the index of git
+ */
+int cbuild_fingerprint_is_racy(const cbuild_file_fingerprint *fingerprint)
 {
-    assert(map->size != map->capacity && "Map is full");
-    size_t i = pid % map->capacity;
-    while (map->items[i].pid != 0)
-        i = (i + 1) % map->capacity;
-    map->items[i].pid = pid;
-    map->items[i].target = target;
+    long long taken = fingerprint->taken;
+    // coarse timestamps only tell the second the file was modified in
+    if (fingerprint->mtime % 1000000000LL == 0)
+        taken -= taken % 1000000000LL;
+    return fingerprint->mtime >= taken;
 }
 
-void cbuild_target_map_remove(cbuild_target_map *map, pid_t pid)
+unsigned long long cbuild_get_file_hash(const char *file)
 {
-    assert(map->size != map->capacity && "Map is full");
-    size_t i = pid % map->capacity;
-    while (map->items[i].pid != pid)
-        i = (i + 1) % map->capacity;
-    map->items[i].pid = 0;
-    map->items[i].target = NULL;
+    if (!cbuild_fingerprints_loaded)
+        cbuild_load_fingerprints();
 
+    struct stat st;
+    if (cbuild_stat(file, &st) == -1)
+        return 0;
+    cbuild_file_fingerprint *fingerprint = cbuild_get_fingerprint_entry(file);
+    if (fingerprint->size != st.st_size
+            || fingerprint->mtime != cbuild_stat_mtime(&st)
+            || fingerprint->inode != st.st_ino || fingerprint->hash == 0
+            || cbuild_fingerprint_is_racy(fingerprint))
+    {
+        fingerprint->size = st.st_size;
+        fingerprint->mtime = cbuild_stat_mtime(&st);
+        fingerprint->inode = st.st_ino;
+        fingerprint->taken = cbuild_timestamp_clock();
+        fingerprint->hash = cbuild_hash_file(file);
+    }
+    return fingerprint->hash;
 }
 
-cbuild_target *cbuild_target_map_get(cbuild_target_map *map, pid_t pid)
+int cbuild_save_fingerprints(void)
 {
-    assert(map->size != map->capacity && "Map is full");
-    size_t i = pid % map->capacity;
-    while (map->items[i].pid != pid)
-        i = (i + 1) % map->capacity;
-    return map->items[i].target;
+    if (!cbuild_fingerprints_loaded)
+        return 0;
+    if (mkdir(cbuild_state_dir, 0755) == -1 && errno != EEXIST)
+    {
+        cbuild_log(CBUILD_ERROR, "Could not create %s: %s", cbuild_state_dir,
+                   strerror(errno));
+        return 1;
+    }
+    char *path = cbuild_state_file("fingerprints");
+    char *tmp_path = cbuild_state_file("fingerprints.tmp");
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL)
+    {
+        cbuild_log(CBUILD_ERROR, "Could not open %s: %s", tmp_path,
+                   strerror(errno));
+        free(path);
+        free(tmp_path);
+        return 1;
+    }
+    for (size_t i = 0; i < cbuild_fingerprints.capacity; i++)
+    {
+        cbuild_file_fingerprint *fingerprint = cbuild_fingerprints.values[i];
+        if (fingerprint == NULL || fingerprint->hash == 0)
+            continue;
+        fprintf(file, "%s\tsize=%lld\tmtime_ns=%lld\tinode=%llu\thash=%016llx"
+                "\ttaken_ns=%lld\n", fingerprint->file, fingerprint->size,
+                fingerprint->mtime, fingerprint->inode, fingerprint->hash,
+                fingerprint->taken);
+    }
+    int error = fclose(file) != 0 || cbuild_rename(tmp_path, path);
+    free(path);
+    free(tmp_path);
+    return error;
 }
 
-cbuild_target *cbuild_find_buildable_target(cbuild_target_stack *targets)
+/*** deps log impl ***/
+
+/*
+ * The deps log is an append-only binary file. After a header, it contains
+ * records starting with a 32 bits word: the size of the record's payload, with
+ * the highest bit set for deps records.
+ * - path records contain a path, padded with '\0' to a multiple of 4 bytes.
+ *   Each path gets the index of its record as an id.
+ * - deps records contain the id of a target file followed by the ids of its
+ *   dependencies, and replace the previous records of the same target.
+ */
+#define CBUILD_DEPS_LOG_MAGIC "# cbuild deps log\n"
+#define CBUILD_DEPS_LOG_VERSION 1
+#define CBUILD_DEPS_RECORD_FLAG 0x80000000u
+
+static cbuild_str_vector cbuild_deps_paths = { 0 }; ///< path of each id
+static cbuild_hash_map cbuild_deps_path_ids = { 0 }; ///< id + 1 of each path
+static cbuild_hash_map cbuild_deps = { 0 }; ///< deps of each target file
+static size_t cbuild_deps_nb_logged_paths = 0;
+static size_t cbuild_deps_nb_records = 0;
+static int cbuild_deps_loaded = 0;
+static FILE *cbuild_deps_log = NULL;
+
+/**
+ * returns the id of a path, adding it if needed
+ */
+unsigned cbuild_deps_path_id(const char *path, size_t size)
 {
-    if (targets->head == NULL)
-        return NULL;
-    cbuild_target_stack_item *it = targets->head;
-    cbuild_target *current = it->target;
-    if (it != NULL)
+    char *key = strndup(path, size);
+    size_t id = (size_t)cbuild_hash_map_get(&cbuild_deps_path_ids, key);
+    if (id != 0)
     {
-        size_t i = 0;
-        for (; current->sources[i].source_type; i++)
-        {
-            if (current->sources[i].source_type == CBUILD_TARGET_SOURCE
-                    && !current->sources[i].source.target->is_built)
-                break;
-        }
-        if (current->sources[i].source_type == CBUILD_NONE)
-        {
-            targets->head = it->next;
-            return it->target;
-        }
-        while (it->next != NULL)
-        {
-            size_t i = 0;
-            current = it->next->target;
-            for (; current->sources[i].source_type; i++)
-            {
-                if (current->sources[i].source_type == CBUILD_TARGET_SOURCE
-                        && !current->sources[i].source.target->is_built)
-                    break;
-            }
-            if (current->sources[i].source_type == CBUILD_NONE)
-            {
-                cbuild_target *res = it->target;
-                it->next = it->next->next;
-                return res;
-            }
-            it = it->next;
-        }
+        free(key);
+        return id - 1;
     }
-    return NULL;
+    cbuild_str_vector_add_str(&cbuild_deps_paths, key);
+    cbuild_hash_map_set(&cbuild_deps_path_ids, key,
+                        (void *)cbuild_deps_paths.size);
+    return cbuild_deps_paths.size - 1;
 }
 
-void cbuild_setup_target_stack(cbuild_target *target,
-        cbuild_target_stack *res)
+/**
+ * replaces the deps of a target, the strings of deps must be interned paths
+ */
+void cbuild_deps_set(const char *target_file, cbuild_str_vector *deps)
 {
-    cbuild_target_stack_push(res, target);
-    if (target)
-    for (size_t i = 0; target->sources[i].source_type; i++)
+    cbuild_str_vector *old = cbuild_hash_map_get(&cbuild_deps, target_file);
+    if (old != NULL)
     {
-        if (target->sources[i].source_type == CBUILD_TARGET_SOURCE)
-            cbuild_setup_target_stack(target->sources[i].source.target, res);
+        free(old->strs);
+        free(old);
     }
+    cbuild_hash_map_set(&cbuild_deps, target_file, deps);
+    cbuild_deps_nb_records += 1;
 }
 
-int cbuild_multiprocess_build_target(cbuild_target *target, int *built,
-        int always_recompile, unsigned nb_process)
+/**
+ * opens a new deps log for writing, with its header
+ */
+FILE *cbuild_create_deps_log(const char *path)
 {
-    cbuild_target_stack targets = { 0 };
-    cbuild_setup_target_stack(target, &targets);
-    cbuild_target_map map = { 0 };
-    cbuild_target_map_init(&map, nb_process);
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+        return NULL;
+    unsigned version = CBUILD_DEPS_LOG_VERSION;
+    fwrite(CBUILD_DEPS_LOG_MAGIC, 1, strlen(CBUILD_DEPS_LOG_MAGIC), file);
+    fwrite(&version, sizeof(version), 1, file);
+    return file;
+}
 
-    unsigned running_processes = 0;
-    int error = 0;
-    while (targets.head != NULL && !error)
+/**
+ * writes the records of the paths added since the last ones were written
+ */
+void cbuild_deps_log_paths(void)
+{
+    char padding[4] = { 0 };
+    for (; cbuild_deps_nb_logged_paths < cbuild_deps_paths.size;
+         cbuild_deps_nb_logged_paths++)
     {
-        while (running_processes < nb_process)
-        {
-            cbuild_target *to_build = cbuild_find_buildable_target(&targets);
-            if (to_build == NULL)
+        char *path = cbuild_deps_paths.strs[cbuild_deps_nb_logged_paths];
+        size_t size = strlen(path);
+        unsigned padded = (size + 4) & ~3u;
+        fwrite(&padded, sizeof(padded), 1, cbuild_deps_log);
+        fwrite(path, 1, size, cbuild_deps_log);
+        fwrite(padding, 1, padded - size, cbuild_deps_log);
+    }
+}
+
+/**
+ * writes a deps record, all the paths must have been logged
+ */
+void cbuild_deps_log_record(const char *target_file, cbuild_str_vector *deps)
+{
+    unsigned target_id = (size_t)cbuild_hash_map_get(&cbuild_deps_path_ids,
+                                                     target_file) - 1;
+    unsigned head = ((deps->size + 1) * sizeof(unsigned))
+        | CBUILD_DEPS_RECORD_FLAG;
+    fwrite(&head, sizeof(head), 1, cbuild_deps_log);
+    fwrite(&target_id, sizeof(target_id), 1, cbuild_deps_log);
+    for (size_t i = 0; i < deps->size; i++)
+    {
+        unsigned id = (size_t)cbuild_hash_map_get(&cbuild_deps_path_ids,
+                                                  deps->strs[i]) - 1;
+        fwrite(&id, sizeof(id), 1, cbuild_deps_log);
+    }
+}
+
+/**
+ * rewrites the log with only the latest record of each target, when most of
+ * its records are outdated
+ */
+void cbuild_recompact_deps_log(const char *path)
+{
+    char *tmp_path = cbuild_state_file("deps.tmp");
+    cbuild_deps_log = cbuild_create_deps_log(tmp_path);
+    if (cbuild_deps_log == NULL)
+    {
+        free(tmp_path);
+        return;
+    }
+    cbuild_deps_nb_logged_paths = 0;
+    cbuild_deps_log_paths();
+    for (size_t i = 0; i < cbuild_deps.capacity; i++)
+    {
+        if (cbuild_deps.keys[i] != NULL)
+            cbuild_deps_log_record(cbuild_deps.keys[i], cbuild_deps.values[i]);
+    }
+    if (fclose(cbuild_deps_log) == 0 && cbuild_rename(tmp_path, (char *)path) == 0)
+        cbuild_deps_nb_records = cbuild_deps.size;
+    cbuild_deps_log = NULL;
+    free(tmp_path);
+}
+
+void cbuild_load_deps_log(void)
+{
+    cbuild_deps_loaded = 1;
+    char *path = cbuild_state_file("deps");
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        free(path);
+        return;
+    }
+    struct stat st;
+    char *content = NULL;
+    if (fstat(fileno(file), &st) == -1
+            || (content = malloc(st.st_size + 1)) == NULL
+            || fread(content, 1, st.st_size, file) != (size_t)st.st_size)
+    {
+        free(content);
+        fclose(file);
+        free(path);
+        return;
+    }
+    fclose(file);
+
+    size_t header_size = strlen(CBUILD_DEPS_LOG_MAGIC) + sizeof(unsigned);
+    size_t offset = header_size;
+    unsigned version = 0;
+    if ((size_t)st.st_size >= header_size)
+        memcpy(&version, content + header_size - sizeof(unsigned),
+               sizeof(unsigned));
+    if ((size_t)st.st_size < header_size || version != CBUILD_DEPS_LOG_VERSION
+            || memcmp(content, CBUILD_DEPS_LOG_MAGIC,
+                      strlen(CBUILD_DEPS_LOG_MAGIC)) != 0)
+    {
+        cbuild_log(CBUILD_WARN, "Ignoring invalid deps log `%s'", path);
+        remove(path);
+        free(content);
+        free(path);
+        return;
+    }
+
+    while (offset + sizeof(unsigned) <= (size_t)st.st_size)
+    {
+        unsigned head;
+        memcpy(&head, content + offset, sizeof(head));
+        size_t size = head & ~CBUILD_DEPS_RECORD_FLAG;
+        char *payload = content + offset + sizeof(head);
+        if (size % 4 != 0 || size == 0
+                || offset + sizeof(head) + size > (size_t)st.st_size)
+            break;
+        if (head & CBUILD_DEPS_RECORD_FLAG)
+        {
+            unsigned *ids = (unsigned *)payload;
+            size_t nb_ids = size / sizeof(unsigned);
+            size_t i = 0;
+            while (i < nb_ids && ids[i] < cbuild_deps_paths.size)
+                i++;
+            if (i != nb_ids)
+                break;
+            cbuild_str_vector *deps = calloc(1, sizeof(cbuild_str_vector));
+            for (i = 1; i < nb_ids; i++)
+                cbuild_str_vector_add_str(deps, cbuild_deps_paths.strs[ids[i]]);
+            cbuild_deps_set(cbuild_deps_paths.strs[ids[0]], deps);
+        }
+        else
+        {
+            if (payload[size - 1] != '\0')
+                break;
+            cbuild_deps_path_id(payload, strlen(payload));
+        }
+        offset += sizeof(head) + size;
+    }
+    free(content);
+    cbuild_deps_nb_logged_paths = cbuild_deps_paths.size;
+
+    if (offset != (size_t)st.st_size)
+    {
+        // a build was interrupted while writing a record
+        cbuild_log(CBUILD_WARN, "Truncating deps log `%s'", path);
+        if (truncate(path, offset) == -1)
+            remove(path);
+    }
+    if (cbuild_deps_nb_records > 1000
+            && cbuild_deps_nb_records > 3 * cbuild_deps.size)
+        cbuild_recompact_deps_log(path);
+    free(path);
+}
+
+cbuild_str_vector *cbuild_get_discovered_deps(const char *target_file)
+{
+    if (!cbuild_deps_loaded)
+        cbuild_load_deps_log();
+    return cbuild_hash_map_get(&cbuild_deps, target_file);
+}
+
+int cbuild_record_discovered_deps(const char *target_file,
+        cbuild_str_vector *deps)
+{
+    if (!cbuild_deps_loaded)
+        cbuild_load_deps_log();
+    if (cbuild_deps_log == NULL)
+    {
+        if (mkdir(cbuild_state_dir, 0755) == -1 && errno != EEXIST)
+            return 1;
+        char *path = cbuild_state_file("deps");
+        cbuild_deps_log = fopen(path, "ab");
+        if (cbuild_deps_log != NULL && fseek(cbuild_deps_log, 0, SEEK_END) == 0
+                && ftell(cbuild_deps_log) == 0)
+        {
+            fclose(cbuild_deps_log);
+            cbuild_deps_log = cbuild_create_deps_log(path);
+            cbuild_deps_nb_logged_paths = 0;
+        }
+        free(path);
+        if (cbuild_deps_log == NULL)
+            return 1;
+    }
+
+    unsigned target_id = cbuild_deps_path_id(target_file, strlen(target_file));
+    cbuild_str_vector *copy = calloc(1, sizeof(cbuild_str_vector));
+    for (size_t i = 0; i < deps->size; i++)
+    {
+        unsigned id = cbuild_deps_path_id(deps->strs[i], strlen(deps->strs[i]));
+        cbuild_str_vector_add_str(copy, cbuild_deps_paths.strs[id]);
+    }
+    cbuild_deps_set(cbuild_deps_paths.strs[target_id], copy);
+    cbuild_deps_log_paths();
+    cbuild_deps_log_record(cbuild_deps_paths.strs[target_id], copy);
+    return fflush(cbuild_deps_log) != 0;
+}
+
+/**
+ * closes the deps log, the next records will open it again
+ */
+void cbuild_close_deps_log(void)
+{
+    if (cbuild_deps_log != NULL)
+        fclose(cbuild_deps_log);
+    cbuild_deps_log = NULL;
+}
+
+int cbuild_parse_depfile(const char *depfile, cbuild_str_vector *deps)
+{
+    FILE *file = fopen(depfile, "rb");
+    if (file == NULL)
+        return 1;
+    struct stat st;
+    char *content = NULL;
+    if (fstat(fileno(file), &st) == -1
+            || (content = malloc(st.st_size + 1)) == NULL
+            || fread(content, 1, st.st_size, file) != (size_t)st.st_size)
+    {
+        free(content);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+    content[st.st_size] = '\0';
+
+    // words are unescaped in place, the ones ending with ':' are the targets
+    char *in = content;
+    while (*in != '\0')
+    {
+        // non-ASCII paths have bytes above 0x7f, negative as chars
+        if (isspace((unsigned char)*in)
+                || (in[0] == '\\' && (in[1] == '\n' || in[1] == '\r')))
+        {
+            in += 1 + (*in == '\\');
+            continue;
+        }
+        char *word = in;
+        char *out = in;
+        while (*in != '\0' && !isspace((unsigned char)*in))
+        {
+            if (in[0] == '\\' && (in[1] == ' ' || in[1] == '#'
+                                   || in[1] == '\\'))
+                in += 1;
+            else if (in[0] == '\\' && (in[1] == '\n' || in[1] == '\r'))
+                break;
+            else if (in[0] == '$' && in[1] == '$')
+                in += 1;
+            *out++ = *in++;
+        }
+        size_t size = out - word;
+        if (size > 0 && word[size - 1] == ':')
+            continue;
+        unsigned id = cbuild_deps_path_id(word, size);
+        cbuild_str_vector_add_str(deps, cbuild_deps_paths.strs[id]);
+    }
+    free(content);
+    return 0;
+}
+
+/*** arena impl ***/
+
+#define CBUILD_ARENA_BLOCK_SIZE (64 * 1024)
+
+struct cbuild_arena_block
+{
+    struct cbuild_arena_block *next;
+    size_t size; ///< capacity of data
+    size_t used; ///< size of data allocated
+    long double data[]; ///< the allocations, aligned for any type
+};
+
+cbuild_arena cbuild_build_arena = { 0 };
+
+/**
+ * rounds a size up to the alignment of the allocations of an arena
+ */
+size_t cbuild_arena_align(size_t size)
+{
+    size_t alignment = sizeof(long double);
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+void *cbuild_arena_alloc(cbuild_arena *arena, size_t size)
+{
+    size = cbuild_arena_align(size);
+    struct cbuild_arena_block *block = arena->current;
+    // the blocks kept by a reset are used again before new ones are allocated
+    while (block != NULL && block->used + size > block->size
+            && block->next != NULL)
+    {
+        block = block->next;
+        block->used = 0;
+    }
+    if (block == NULL || block->used + size > block->size)
+    {
+        size_t capacity = CBUILD_ARENA_BLOCK_SIZE;
+        if (size > capacity)
+            capacity = size;
+        struct cbuild_arena_block *new_block =
+            malloc(sizeof(struct cbuild_arena_block) + capacity);
+        new_block->next = NULL;
+        new_block->size = capacity;
+        new_block->used = 0;
+        if (block == NULL)
+            arena->first = new_block;
+        else
+            block->next = new_block;
+        block = new_block;
+    }
+    arena->current = block;
+    void *ptr = (char *)block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+void *cbuild_arena_realloc(cbuild_arena *arena, void *ptr, size_t old_size,
+        size_t size)
+{
+    struct cbuild_arena_block *block = arena->current;
+    if (ptr != NULL && block != NULL && (char *)ptr >= (char *)block->data
+            && (char *)ptr < (char *)block->data + block->used)
+    {
+        size_t offset = (char *)ptr - (char *)block->data;
+        if (cbuild_arena_align(offset + old_size) == block->used
+                && offset + size <= block->size)
+        {
+            block->used = cbuild_arena_align(offset + size);
+            return ptr;
+        }
+    }
+    void *res = cbuild_arena_alloc(arena, size);
+    if (ptr != NULL)
+        memcpy(res, ptr, old_size < size ? old_size : size);
+    return res;
+}
+
+void cbuild_arena_reset(cbuild_arena *arena)
+{
+    arena->current = arena->first;
+    if (arena->first != NULL)
+        arena->first->used = 0;
+}
+
+void cbuild_arena_release(cbuild_arena *arena)
+{
+    struct cbuild_arena_block *block = arena->first;
+    while (block != NULL)
+    {
+        struct cbuild_arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    memset(arena, 0, sizeof(*arena));
+}
+
+/**
+ * resizes the array of a string builder or of a vector, from its arena if it
+ * has one
+ */
+void *cbuild_resize_array(cbuild_arena *arena, void *ptr, size_t old_size,
+        size_t size)
+{
+    if (arena == NULL)
+        return realloc(ptr, size);
+    return cbuild_arena_realloc(arena, ptr, old_size, size);
+}
+
+/*** str_builder impl ***/
+
+void cbuild_str_builder_append_char(cbuild_str_builder *sb, char c)
+{
+    if (sb->str == NULL)
+    {
+        sb->capacity = 8;
+        sb->str = cbuild_resize_array(sb->arena, NULL, 0, sb->capacity);
+        sb->size = 0;
+    }
+    if (sb->size == sb->capacity)
+    {
+        sb->capacity *= 2;
+        sb->str = cbuild_resize_array(sb->arena, sb->str, sb->size,
+                                      sb->capacity);
+    }
+
+    sb->str[sb->size++] = c;
+}
+
+void cbuild_str_builder_append_cstr(cbuild_str_builder *str, char *cstr)
+{
+    for (size_t i = 0; cstr[i] != 0; i++)
+        cbuild_str_builder_append_char(str, cstr[i]);
+}
+
+void cbuild_str_builder_append_data(cbuild_str_builder *str, const char *data,
+        size_t size)
+{
+    if (str->size + size > str->capacity)
+    {
+        size_t capacity = str->capacity ? str->capacity : 8;
+        while (capacity < str->size + size)
+            capacity *= 2;
+        str->str = cbuild_resize_array(str->arena, str->str, str->size,
+                                       capacity);
+        str->capacity = capacity;
+    }
+    memcpy(str->str + str->size, data, size);
+    str->size += size;
+}
+
+char *cbuild_str_builder_to_cstr(cbuild_str_builder *str)
+{
+    cbuild_str_builder_append_char(str, '\0');
+    char *res = str->str;
+    str->capacity = 0;
+    str->size = 0;
+    str->str = NULL;
+    return res;
+}
+
+void cbuild_str_vector_add_str(cbuild_str_vector *vector, char *str)
+{
+    if (vector->strs == NULL)
+    {
+        vector->capacity = 8;
+        vector->strs = cbuild_resize_array(vector->arena, NULL, 0,
+                                           vector->capacity * sizeof(char *));
+        vector->size = 0;
+    }
+    if (vector->size == vector->capacity)
+    {
+        vector->capacity *= 2;
+        vector->strs = cbuild_resize_array(vector->arena, vector->strs,
+                                           vector->size * sizeof(char *),
+                                           vector->capacity * sizeof(char *));
+    }
+    vector->strs[vector->size++] = str;
+}
+
+void __cbuild_str_vector_add_strs(cbuild_str_vector *vector, char *str, ...)
+{
+    va_list ap;
+    va_start(ap, str);
+    cbuild_str_vector_add_str(vector, str);
+    while ((str = va_arg(ap, char *)) != NULL)
+    {
+        cbuild_str_vector_add_str(vector, str);
+    }
+}
+
+void cbuild_str_vector_pop_back(cbuild_str_vector *vector)
+{
+    vector->size--;
+}
+
+char *cbuild_str_vector_join(cbuild_str_vector *vector, char *sep)
+{
+    cbuild_str_builder str_builder = { 0 };
+    cbuild_str_builder_append_cstr(&str_builder, vector->strs[0]);
+    for (size_t i = 1; i < vector->size; i++)
+    {
+        if (vector->strs[i] == NULL)
+            continue;
+        cbuild_str_builder_append_cstr(&str_builder, sep);
+        cbuild_str_builder_append_cstr(&str_builder, vector->strs[i]);
+    }
+    return cbuild_str_builder_to_cstr(&str_builder);
+}
+
+void cbuild_command_add_arg(cbuild_command *command, char *arg)
+{
+    cbuild_str_vector_pop_back(&command->argv);
+    cbuild_str_vector_add_str(&command->argv, arg);
+    cbuild_str_vector_add_str(&command->argv, NULL);
+}
+
+void __cbuild_command_add_args(cbuild_command *command, char *arg, ...)
+{
+    cbuild_str_vector_pop_back(&command->argv);
+    va_list ap;
+    va_start(ap, arg);
+    cbuild_str_vector_add_str(&command->argv, arg);
+    while ((arg = va_arg(ap, char *)) != NULL)
+    {
+        cbuild_str_vector_add_str(&command->argv, arg);
+    }
+    cbuild_str_vector_add_str(&command->argv, NULL);
+}
+
+int pid_wait(pid_t pid)
+{
+    int stat_loc;
+    waitpid(pid, &stat_loc, 0);
+    return WEXITSTATUS(stat_loc);
+}
+
+/**
+ * executes a command asynchronously, its standard output and error being the
+ * given file descriptors, or the ones of cbuild if -1. The command is logged
+ * before posix_spawn starts it, so that the child does nothing but exec: it
+ * does not copy the page tables of cbuild, which get large with big graphs.
+ * With new_group, the command gets its own process group, to be stopped along
+ * with the processes it starts
+ */
+int __cbuild_command_exec_async(cbuild_command *command, int stdout_fd,
+        int stderr_fd, int new_group)
+{
+    assert(command->argv.size > 1);
+
+    char *command_str = cbuild_str_vector_join(&command->argv, " ");
+    cbuild_log(CBUILD_INFO, "CMD `%s'", command_str);
+    fflush(stdout);
+
+    posix_spawn_file_actions_t file_actions;
+    posix_spawn_file_actions_init(&file_actions);
+    if (stdout_fd != -1)
+        posix_spawn_file_actions_adddup2(&file_actions, stdout_fd,
+                                         STDOUT_FILENO);
+    if (stderr_fd != -1)
+        posix_spawn_file_actions_adddup2(&file_actions, stderr_fd,
+                                         STDERR_FILENO);
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    if (new_group)
+    {
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attributes, 0);
+    }
+    pid_t pid;
+    int error = posix_spawnp(&pid, command->argv.strs[0], &file_actions,
+                             &attributes, command->argv.strs, environ);
+    posix_spawn_file_actions_destroy(&file_actions);
+    posix_spawnattr_destroy(&attributes);
+    if (error != 0)
+    {
+        cbuild_log(CBUILD_ERROR, "Could not run `%s': %s", command_str,
+                   strerror(error));
+        pid = -1;
+    }
+    free(command_str);
+    return pid;
+}
+
+int cbuild_command_exec_async(cbuild_command *command)
+{
+    return __cbuild_command_exec_async(command, -1, -1, 0);
+}
+
+int cbuild_command_exec_sync(cbuild_command *command)
+{
+    pid_t pid = cbuild_command_exec_async(command);
+    if (pid == -1)
+        return -1;
+    return pid_wait(pid);
+}
+
+
+
+cbuild_command_template *cbuild_compile_command_format(const char *format)
+{
+    cbuild_command_template *compiled = calloc(1, sizeof(*compiled));
+    compiled->text = strdup(format);
+    // at most a token per character, %s and %a making two, and the last split
+    compiled->tokens = malloc((strlen(format) + 1)
+                              * sizeof(cbuild_command_token));
+    const char *text = compiled->text;
+    size_t i = 0;
+    while (text[i] != '\0')
+    {
+        cbuild_command_token *token = &compiled->tokens[compiled->size];
+        if (text[i] == '%' && text[i + 1] != '\0'
+                && strchr("tdsa", text[i + 1]) != NULL)
+        {
+            // the sources and the custom arguments are arguments on their own
+            if (text[i + 1] == 's' || text[i + 1] == 'a')
+            {
+                token->kind = CBUILD_TOKEN_SPLIT;
+                token += 1;
+            }
+            token->kind = text[i + 1] == 't' ? CBUILD_TOKEN_TARGET
+                : text[i + 1] == 'd' ? CBUILD_TOKEN_DEPFILE
+                : text[i + 1] == 's' ? CBUILD_TOKEN_SOURCES
+                : CBUILD_TOKEN_ARGS;
+            compiled->size = token - compiled->tokens + 1;
+            i += 2;
+            continue;
+        }
+        if (isspace((unsigned char)text[i]))
+        {
+            while (isspace((unsigned char)text[i]))
+                i++;
+            token->kind = CBUILD_TOKEN_SPLIT;
+            compiled->size++;
+            continue;
+        }
+        // up to the next argument or format, a lone % being text
+        size_t start = i;
+        do
+            i++;
+        while (text[i] != '\0' && text[i] != '%'
+               && !isspace((unsigned char)text[i]));
+        token->kind = CBUILD_TOKEN_TEXT;
+        token->text = text + start;
+        token->size = i - start;
+        compiled->size++;
+    }
+    compiled->tokens[compiled->size++].kind = CBUILD_TOKEN_SPLIT;
+    return compiled;
+}
+
+/**
+ * returns the compiled format of a target, compiling it again if it changed
+ */
+cbuild_command_template *cbuild_target_command_template(cbuild_target *target)
+{
+    cbuild_command_template *compiled = target->command_template;
+    // the format may have been modified in place
+    if (compiled != NULL && strcmp(compiled->text, target->command_format) == 0)
+        return compiled;
+    if (compiled != NULL)
+    {
+        free(compiled->text);
+        free(compiled->tokens);
+        free(compiled);
+    }
+    target->command_template =
+        cbuild_compile_command_format(target->command_format);
+    return target->command_template;
+}
+
+cbuild_command cbuild_target_build_command(cbuild_target *target)
+{
+    cbuild_command_template *compiled = cbuild_target_command_template(target);
+    size_t target_size = strlen(target->target_file);
+    size_t depfile_size = target->depfile ? strlen(target->depfile) : 0;
+
+    // the size of the arguments first, to allocate them along with argv
+    size_t nb_args = 0;
+    size_t size = 0;
+    size_t arg_size = 0;
+    for (size_t i = 0; i < compiled->size; i++)
+    {
+        cbuild_command_token *token = &compiled->tokens[i];
+        switch (token->kind)
+        {
+            case CBUILD_TOKEN_TEXT:
+                arg_size += token->size;
+                break;
+            case CBUILD_TOKEN_TARGET:
+                arg_size += target_size;
+                break;
+            case CBUILD_TOKEN_DEPFILE:
+                arg_size += depfile_size;
+                break;
+            case CBUILD_TOKEN_SOURCES:
+                for (size_t j = 0; target->sources[j].source_type; j++)
+                    nb_args += target->sources[j].add_to_command != 0;
+                break;
+            case CBUILD_TOKEN_ARGS:
+                nb_args += target->command.size;
+                break;
+            case CBUILD_TOKEN_SPLIT:
+                if (arg_size != 0)
+                {
+                    nb_args += 1;
+                    size += arg_size + 1;
+                }
+                arg_size = 0;
+                break;
+        }
+    }
+
+    // argv comes after the arguments, so that it can grow in place
+    size = (size + sizeof(char *) - 1) / sizeof(char *) * sizeof(char *);
+    char *arg = cbuild_arena_alloc(&cbuild_build_arena,
+                                   size + (nb_args + 1) * sizeof(char *));
+    char **argv = (char **)(arg + size);
+    char *end = arg;
+    size_t argc = 0;
+    for (size_t i = 0; i < compiled->size; i++)
+    {
+        cbuild_command_token *token = &compiled->tokens[i];
+        switch (token->kind)
+        {
+            case CBUILD_TOKEN_TEXT:
+                memcpy(end, token->text, token->size);
+                end += token->size;
+                break;
+            case CBUILD_TOKEN_TARGET:
+                memcpy(end, target->target_file, target_size);
+                end += target_size;
+                break;
+            case CBUILD_TOKEN_DEPFILE:
+                if (depfile_size != 0)
+                    memcpy(end, target->depfile, depfile_size);
+                end += depfile_size;
+                break;
+            case CBUILD_TOKEN_SOURCES:
+                for (size_t j = 0; target->sources[j].source_type; j++)
+                {
+                    cbuild_source *source = &target->sources[j];
+                    if (source->add_to_command)
+                        argv[argc++] =
+                            source->source_type == CBUILD_FILE_SOURCE
+                                ? source->source.file
+                                : source->source.target->target_file;
+                }
+                break;
+            case CBUILD_TOKEN_ARGS:
+                for (size_t j = 0; j < target->command.size; j++)
+                    argv[argc++] = target->command.strs[j];
+                break;
+            case CBUILD_TOKEN_SPLIT:
+                if (end != arg)
+                {
+                    *end++ = '\0';
+                    argv[argc++] = arg;
+                    arg = end;
+                }
+                break;
+        }
+    }
+    argv[argc] = NULL;
+
+    cbuild_command command = { 0 };
+    command.argv.strs = argv;
+    command.argv.size = argc + 1;
+    command.argv.capacity = argc + 1;
+    command.argv.arena = &cbuild_build_arena;
+    return command;
+}
+
+static unsigned cbuild_visit_generation = 0;
+
+/**
+ * starts a new traversal of the target graph, making every target unvisited
+ * without having to walk the graph to reset them
+ */
+unsigned cbuild_start_traversal(void)
+{
+    return ++cbuild_visit_generation;
+}
+
+/**
+ * returns true the first time a target is reached during a traversal
+ */
+int cbuild_target_visit(cbuild_target *target, unsigned generation)
+{
+    if (target->visit_generation == generation)
+        return 0;
+    target->visit_generation = generation;
+    return 1;
+}
+
+void __cbuild_clean_target(cbuild_target *target, unsigned generation)
+{
+    if (cbuild_file_exists(target->target_file))
+    {
+        cbuild_log(CBUILD_WARN, "Removing `%s'", target->target_file);
+        remove(target->target_file);
+        cbuild_stat_invalidate(target->target_file);
+    }
+    for (size_t i = 0; target->sources[i].source_type; i++)
+    {
+        if (target->sources[i].source_type == CBUILD_TARGET_SOURCE
+                && cbuild_target_visit(target->sources[i].source.target,
+                                       generation))
+        {
+            __cbuild_clean_target(target->sources[i].source.target,
+                                  generation);
+        }
+    }
+}
+
+int cbuild_clean_target(cbuild_target *target)
+{
+    cbuild_stat_cache_clear();
+    unsigned generation = cbuild_start_traversal();
+    cbuild_target_visit(target, generation);
+    __cbuild_clean_target(target, generation);
+    return 0;
+}
+
+const char *cbuild_source_file(const cbuild_source *source)
+{
+    return source->source_type == CBUILD_FILE_SOURCE
+        ? source->source.file
+        : source->source.target->target_file;
+}
+
+/**
+ * returns the hash of the expanded command of a target
+ */
+unsigned long long cbuild_target_command_hash(cbuild_target *target)
+{
+    cbuild_command command = cbuild_target_build_command(target);
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < command.argv.size && command.argv.strs[i]; i++)
+        hash = cbuild_hash_bytes(hash, command.argv.strs[i],
+                                 strlen(command.argv.strs[i]) + 1);
+    return hash;
+}
+
+/**
+ * same as cbuild_target_is_older_than_source for a target source, except that
+ * with early cutoff the output of the source is considered modified only when
+ * its content last changed
+ */
+int cbuild_target_is_older_than_output(const char *target,
+        cbuild_target *source)
+{
+    struct stat st;
+    if (cbuild_stat(source->target_file, &st) == -1)
+        return 0;
+    long long source_time = cbuild_stat_mtime(&st);
+    if (source->record == NULL)
+        source->record = cbuild_get_target_record(source->target_file);
+    if (source->record->output_hash != 0
+            && source->record->output_hash
+               == cbuild_get_file_hash(source->target_file))
+        source_time = source->record->output_mtime;
+
+    if (cbuild_stat(target, &st) == -1)
+        return 1;
+    return cbuild_mtime_is_newer(source_time, cbuild_stat_mtime(&st));
+}
+
+/**
+ * remembers the hash of the output of a target before rebuilding it, to know
+ * afterwards whether it changed
+ */
+void cbuild_target_remember_output(cbuild_target *target)
+{
+    if (!cbuild_early_cutoff || cbuild_use_content_hash)
+        return;
+    struct stat st;
+    unsigned long long hash = cbuild_get_file_hash(target->target_file);
+    if (hash != target->record->output_hash
+            && cbuild_stat(target->target_file, &st) == 0)
+    {
+        target->record->output_hash = hash;
+        target->record->output_mtime = cbuild_stat_mtime(&st);
+    }
+}
+
+/**
+ * remembers why a target is rebuilt, unless a previous check found a reason
+ * already. Returns true
+ */
+int cbuild_target_set_cause(cbuild_target *target, int kind, const char *file)
+{
+    if (target->cause.kind != CBUILD_CAUSE_NONE)
+        return 1;
+    struct stat st;
+    target->cause.kind = kind;
+    target->cause.file = file;
+    target->cause.source_mtime = 0;
+    target->cause.target_mtime = 0;
+    if (file != NULL && cbuild_stat(file, &st) == 0)
+        target->cause.source_mtime = cbuild_stat_mtime(&st);
+    if (cbuild_stat(target->target_file, &st) == 0)
+        target->cause.target_mtime = cbuild_stat_mtime(&st);
+    else if (kind == CBUILD_CAUSE_NEWER_SOURCE)
+    {
+        target->cause.kind = CBUILD_CAUSE_MISSING_OUTPUT;
+        target->cause.file = NULL;
+        target->cause.source_mtime = 0;
+    }
+    return 1;
+}
+
+int cbuild_target_needs_rebuild(cbuild_target *target)
+{
+    if (target->record == NULL)
+        target->record = cbuild_get_target_record(target->target_file);
+    // targets built before their command was recorded are assumed to have
+    // been built with the current one
+    target->command_hash = cbuild_target_command_hash(target);
+    if (target->record->command_hash == 0)
+        target->record->command_hash = target->command_hash;
+    if (target->record->command_hash != target->command_hash
+            && !cbuild_use_content_hash)
+        return cbuild_target_set_cause(target, CBUILD_CAUSE_COMMAND_CHANGED,
+                                       NULL);
+
+    cbuild_str_vector *deps = NULL;
+    if (target->depfile != NULL)
+    {
+        deps = cbuild_get_discovered_deps(target->target_file);
+        // the headers are unknown until the target is built once
+        if (deps == NULL && !cbuild_use_content_hash)
+            return cbuild_target_set_cause(target,
+                                           CBUILD_CAUSE_UNKNOWN_HEADERS, NULL);
+    }
+
+    if (!cbuild_use_content_hash)
+    {
+        for (size_t i = 0; target->sources[i].source_type; i++)
+        {
+            const char *file = cbuild_source_file(&target->sources[i]);
+            if (cbuild_early_cutoff
+                    && target->sources[i].source_type == CBUILD_TARGET_SOURCE
+                    ? cbuild_target_is_older_than_output(
+                            target->target_file,
+                            target->sources[i].source.target)
+                    : cbuild_target_is_older_than_source(target->target_file,
+                                                         file))
+                return cbuild_target_set_cause(target,
+                        CBUILD_CAUSE_NEWER_SOURCE, file);
+        }
+        for (size_t i = 0; deps && i < deps->size; i++)
+        {
+            struct stat st;
+            if (cbuild_stat(deps->strs[i], &st) == -1)
+                return cbuild_target_set_cause(target,
+                        CBUILD_CAUSE_MISSING_SOURCE, deps->strs[i]);
+            if (cbuild_target_is_older_than_source(target->target_file,
+                                                   deps->strs[i]))
+                return cbuild_target_set_cause(target,
+                        CBUILD_CAUSE_NEWER_SOURCE, deps->strs[i]);
+        }
+        return 0;
+    }
+
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; target->sources[i].source_type; i++)
+    {
+        const char *file = cbuild_source_file(&target->sources[i]);
+        unsigned long long file_hash = cbuild_get_file_hash(file);
+        hash = cbuild_hash_bytes(hash, file, strlen(file) + 1);
+        hash = cbuild_hash_bytes(hash, &file_hash, sizeof(file_hash));
+    }
+    for (size_t i = 0; deps && i < deps->size; i++)
+    {
+        unsigned long long file_hash = cbuild_get_file_hash(deps->strs[i]);
+        hash = cbuild_hash_bytes(hash, deps->strs[i], strlen(deps->strs[i]) + 1);
+        hash = cbuild_hash_bytes(hash, &file_hash, sizeof(file_hash));
+    }
+    target->inputs_hash = hash;
+    if (target->record->command_hash != target->command_hash)
+        return cbuild_target_set_cause(target, CBUILD_CAUSE_COMMAND_CHANGED,
+                                       NULL);
+    if (target->depfile != NULL && deps == NULL)
+        return cbuild_target_set_cause(target, CBUILD_CAUSE_UNKNOWN_HEADERS,
+                                       NULL);
+    if (cbuild_get_file_hash(target->target_file) == 0)
+        return cbuild_target_set_cause(target, CBUILD_CAUSE_MISSING_OUTPUT,
+                                       NULL);
+    if (hash != target->record->inputs_hash)
+        return cbuild_target_set_cause(target, CBUILD_CAUSE_INPUTS_CHANGED,
+                                       NULL);
+    return 0;
+}
+
+/**
+ * checks once per multiprocess build whether a target needs to be rebuilt:
+ * it is checked when it becomes ready, to prefetch its cache entry, then
+ * when it is popped from the ready queue
+ */
+int cbuild_target_check(cbuild_target *target)
+{
+    if (target->stale == -1)
+    {
+        target->cause.kind = CBUILD_CAUSE_NONE;
+        target->stale = cbuild_target_needs_rebuild(target);
+    }
+    return target->stale;
+}
+
+/**
+ * remembers the command, the discovered headers, the sources and the output of
+ * a target that was successfully built
+ */
+void cbuild_target_built(cbuild_target *target)
+{
+    target->record->command_hash = target->command_hash;
+    target->changed = 1;
+    // the output was just written, even if it has the same size and the same
+    // modification time on filesystems with timestamps in whole seconds
+    if (cbuild_early_cutoff || cbuild_use_content_hash)
+    {
+        if (!cbuild_fingerprints_loaded)
+            cbuild_load_fingerprints();
+        cbuild_get_fingerprint_entry(target->target_file)->hash = 0;
+    }
+    if (cbuild_early_cutoff && !cbuild_use_content_hash)
+    {
+        struct stat st;
+        unsigned long long hash = cbuild_get_file_hash(target->target_file);
+        if (hash != 0 && hash == target->record->output_hash)
+            target->changed = 0;
+        else if (cbuild_stat(target->target_file, &st) == 0)
+        {
+            target->record->output_hash = hash;
+            target->record->output_mtime = cbuild_stat_mtime(&st);
+        }
+    }
+    if (target->depfile != NULL)
+    {
+        cbuild_str_vector deps = { 0 };
+        if (cbuild_parse_depfile(target->depfile, &deps) != 0)
+            cbuild_log(CBUILD_WARN, "Could not read depfile `%s' of `%s'",
+                       target->depfile, target->target_file);
+        else
+            cbuild_record_discovered_deps(target->target_file, &deps);
+        free(deps.strs);
+    }
+    if (!cbuild_use_content_hash)
+        return;
+    // the headers may have changed the hash of the inputs
+    cbuild_target_needs_rebuild(target);
+    target->record->inputs_hash = target->inputs_hash;
+    cbuild_get_file_hash(target->target_file);
+}
+
+/*** cache impl ***/
+
+const char *cbuild_cache_dir = NULL;
+unsigned long long cbuild_cache_max_size = 5ULL << 30;
+const char *cbuild_remote_cache_dir = NULL;
+unsigned cbuild_remote_cache_jobs = 4;
+
+static int cbuild_cache_stored = 0;
+
+int cbuild_copy_file(const char *source, const char *destination)
+{
+    char *tmp = malloc(strlen(destination) + 32);
+    sprintf(tmp, "%s.%d.tmp", destination, (int)getpid());
+    int in = open(source, O_RDONLY);
+    if (in == -1)
+    {
+        free(tmp);
+        return 1;
+    }
+    struct stat st;
+    int out = -1;
+    if (fstat(in, &st) == -1
+            || (out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC,
+                           st.st_mode & 0777)) == -1)
+    {
+        close(in);
+        free(tmp);
+        return 1;
+    }
+
+    int error = 1;
+#ifdef FICLONE
+    error = ioctl(out, FICLONE, in) == -1;
+#endif /* FICLONE */
+    char buffer[65536];
+    ssize_t size = 0;
+    while (error && (size = read(in, buffer, sizeof(buffer))) > 0)
+    {
+        if (write(out, buffer, size) != size)
+            break;
+    }
+    if (error && size == 0)
+        error = 0;
+    close(in);
+    error |= close(out) != 0;
+    if (!error)
+        error = rename(tmp, destination) != 0;
+    if (error)
+        remove(tmp);
+    free(tmp);
+    return error;
+}
+
+/**
+ * creates a directory and its parents
+ */
+int cbuild_make_directories(const char *path)
+{
+    char *copy = strdup(path);
+    for (char *it = copy + 1; *it != '\0'; it++)
+    {
+        if (*it != '/')
+            continue;
+        *it = '\0';
+        mkdir(copy, 0755);
+        *it = '/';
+    }
+    int error = mkdir(copy, 0755) == -1 && errno != EEXIST;
+    free(copy);
+    return error;
+}
+
+/**
+ * creates the directories containing a file
+ */
+int cbuild_make_parent_directories(const char *path)
+{
+    char *copy = strdup(path);
+    char *slash = strrchr(copy, '/');
+    int error = 0;
+    if (slash != NULL && slash != copy)
+    {
+        *slash = '\0';
+        error = cbuild_make_directories(copy);
+    }
+    free(copy);
+    return error;
+}
+
+const char *cbuild_get_remote_cache_dir(void)
+{
+    if (cbuild_remote_cache_dir == NULL)
+        cbuild_remote_cache_dir = getenv("CBUILD_REMOTE_CACHE_DIR");
+    if (cbuild_remote_cache_dir != NULL && cbuild_remote_cache_dir[0] == '\0')
+        cbuild_remote_cache_dir = NULL;
+    return cbuild_remote_cache_dir;
+}
+
+const char *cbuild_get_cache_dir(void)
+{
+    if (cbuild_cache_dir == NULL)
+        cbuild_cache_dir = getenv("CBUILD_CACHE_DIR");
+    if (cbuild_cache_dir != NULL && cbuild_cache_dir[0] == '\0')
+        cbuild_cache_dir = NULL;
+    // the entries of the remote cache are fetched in a local one
+    static char *default_dir = NULL;
+    if (cbuild_cache_dir == NULL && cbuild_get_remote_cache_dir() != NULL)
+    {
+        if (default_dir == NULL)
+            default_dir = cbuild_state_file("cache");
+        cbuild_cache_dir = default_dir;
+    }
+    return cbuild_cache_dir;
+}
+
+/**
+ * returns the newly allocated path of a file of the cache entry of a key
+ */
+char *cbuild_cache_path(unsigned long long key, const char *name)
+{
+    const char *dir = cbuild_get_cache_dir();
+    char *path = malloc(strlen(dir) + strlen(name) + 32);
+    sprintf(path, "%s/%02llx/%016llx%s", dir, key >> 56, key, name);
+    return path;
+}
+
+void cbuild_remove_directory(const char *path)
+{
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (ent->d_name[0] == '.')
+            continue;
+        char *file = malloc(strlen(path) + strlen(ent->d_name) + 2);
+        sprintf(file, "%s/%s", path, ent->d_name);
+        remove(file);
+        free(file);
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+/*** remote cache impl ***/
+
+#define CBUILD_REMOTE_MAGIC "CBUILDR1"
+
+/**
+ * header of a blob of the remote cache, followed by its content
+ */
+typedef struct {
+    char magic[8];
+    unsigned long long size; ///< size of the content
+    unsigned long long hash; ///< hash of the content
+} cbuild_remote_header;
+
+/**
+ * a file of a blob of the remote cache, followed by its data
+ */
+typedef struct {
+    char name[16]; ///< name of the file in the local entry
+    unsigned long long mode; ///< permissions of the file
+    unsigned long long size; ///< size of the data
+} cbuild_remote_section;
+
+typedef struct {
+    unsigned long long key;
+    const char *suffix; ///< "" for an entry, ".deps" for a manifest
+    int upload; ///< whether the entry is stored or fetched
+} cbuild_remote_job;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t *threads;
+    size_t nb_threads;
+    cbuild_remote_job *jobs;
+    size_t head; ///< index of the next job to run
+    size_t size;
+    size_t capacity;
+    unsigned counter; ///< used for the names of the temporary files
+    int stopping;
+} cbuild_remote = {
+    .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER
+};
+
+/**
+ * returns the newly allocated path of a blob of the remote cache. It has two
+ * levels of shards to keep the directories of a large cache small
+ */
+char *cbuild_remote_cache_path(unsigned long long key, const char *suffix)
+{
+    const char *dir = cbuild_get_remote_cache_dir();
+    char *path = malloc(strlen(dir) + strlen(suffix) + 40);
+    sprintf(path, "%s/%02llx/%02llx/%016llx%s", dir, key >> 56,
+            (key >> 48) & 0xff, key, suffix);
+    return path;
+}
+
+/**
+ * returns a newly allocated unique path in the tmp directory of a cache. The
+ * host name is part of it as the remote cache is shared by several hosts
+ */
+char *cbuild_cache_tmp_path(const char *dir)
+{
+    char host[64] = { 0 };
+    gethostname(host, sizeof(host) - 1);
+    pthread_mutex_lock(&cbuild_remote.lock);
+    unsigned counter = cbuild_remote.counter++;
+    pthread_mutex_unlock(&cbuild_remote.lock);
+    char *path = malloc(strlen(dir) + strlen(host) + 64);
+    sprintf(path, "%s/tmp", dir);
+    cbuild_make_directories(path);
+    sprintf(path, "%s/tmp/%s-%d-r%u", dir, host, (int)getpid(), counter);
+    return path;
+}
+
+/**
+ * returns the newly allocated content of a file, NULL if it cannot be read
+ */
+char *cbuild_read_file(const char *path, size_t *size, unsigned *mode)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    struct stat st;
+    char *data = NULL;
+    if (fstat(fd, &st) == 0 && (data = malloc(st.st_size + 1)) != NULL)
+    {
+        size_t done = 0;
+        ssize_t size_read;
+        while (done < (size_t)st.st_size
+                && (size_read = read(fd, data + done, st.st_size - done)) > 0)
+            done += size_read;
+        if (done != (size_t)st.st_size)
+        {
+            free(data);
+            data = NULL;
+        }
+        *size = st.st_size;
+        *mode = st.st_mode & 0777;
+    }
+    close(fd);
+    return data;
+}
+
+int cbuild_write_file(const char *path, const char *data, size_t size,
+        unsigned mode)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd == -1)
+        return 1;
+    ssize_t size_written;
+    while (size > 0 && (size_written = write(fd, data, size)) > 0)
+    {
+        data += size_written;
+        size -= size_written;
+    }
+    int error = size != 0;
+    error |= close(fd) != 0;
+    return error;
+}
+
+/**
+ * stores an entry of the local cache, or a manifest, in the remote one as a
+ * single blob: a header with the size and the hash of the content, then the
+ * files of the entry. The blob is written aside and renamed, so that the
+ * other hosts never see it partially written
+ */
+int cbuild_remote_cache_store(unsigned long long key, const char *suffix)
+{
+    char *remote = cbuild_remote_cache_path(key, suffix);
+    struct stat st;
+    if (stat(remote, &st) == 0)
+    {
+        free(remote);
+        return 0;
+    }
+
+    const char *entry_names[] = { "output", "stdout", "stderr", "depfile" };
+    const char *manifest_names[] = { "deps" };
+    int is_manifest = suffix[0] != '\0';
+    const char **names = is_manifest ? manifest_names : entry_names;
+    size_t nb_names = is_manifest ? 1 : 4;
+    char *local = cbuild_cache_path(key, suffix);
+    char *file = malloc(strlen(local) + 16);
+    size_t blob_size = sizeof(cbuild_remote_header);
+    char *blob = calloc(1, blob_size);
+    int error = 0;
+    for (size_t i = 0; !error && i < nb_names; i++)
+    {
+        if (is_manifest)
+            strcpy(file, local);
+        else
+            sprintf(file, "%s/%s", local, names[i]);
+        cbuild_remote_section section = { { 0 }, 0, 0 };
+        size_t size = 0;
+        unsigned mode = 0;
+        char *data = cbuild_read_file(file, &size, &mode);
+        // the entry may have been evicted, its other files are optional
+        error = data == NULL && i == 0;
+        if (data == NULL)
+            continue;
+        strcpy(section.name, names[i]);
+        section.mode = mode;
+        section.size = size;
+        blob = realloc(blob, blob_size + sizeof(section) + size);
+        memcpy(blob + blob_size, &section, sizeof(section));
+        memcpy(blob + blob_size + sizeof(section), data, size);
+        blob_size += sizeof(section) + size;
+        free(data);
+    }
+
+    if (!error)
+    {
+        cbuild_remote_header header = { CBUILD_REMOTE_MAGIC, 0, 0 };
+        header.size = blob_size - sizeof(header);
+        header.hash = cbuild_hash_bytes(14695981039346656037ULL,
+                                        blob + sizeof(header), header.size);
+        memcpy(blob, &header, sizeof(header));
+        char *tmp = cbuild_cache_tmp_path(cbuild_get_remote_cache_dir());
+        error = cbuild_write_file(tmp, blob, blob_size, 0644);
+        if (!error)
+        {
+            cbuild_make_parent_directories(remote);
+            error = rename(tmp, remote) != 0;
+        }
+        if (error)
+            remove(tmp);
+        free(tmp);
+    }
+    free(blob);
+    free(file);
+    free(local);
+    free(remote);
+    return error;
+}
+
+/**
+ * fetches an entry, or a manifest, of the remote cache into the local one.
+ * Returns 0 if it is available locally, 2 if the blob was corrupted, in which
+ * case it is removed so that a host stores it again
+ */
+int cbuild_remote_cache_fetch(unsigned long long key, const char *suffix)
+{
+    if (cbuild_get_remote_cache_dir() == NULL)
+        return 1;
+    char *local = cbuild_cache_path(key, suffix);
+    struct stat st;
+    if (stat(local, &st) == 0)
+    {
+        free(local);
+        return 0;
+    }
+
+    int is_manifest = suffix[0] != '\0';
+    char *remote = cbuild_remote_cache_path(key, suffix);
+    size_t size = 0;
+    unsigned mode = 0;
+    char *blob = cbuild_read_file(remote, &size, &mode);
+    cbuild_remote_header header;
+    int error = blob == NULL;
+    if (!error)
+    {
+        memcpy(&header, blob, size < sizeof(header) ? size : sizeof(header));
+        if (size < sizeof(header)
+                || memcmp(header.magic, CBUILD_REMOTE_MAGIC, 8) != 0
+                || header.size != size - sizeof(header)
+                || header.hash != cbuild_hash_bytes(14695981039346656037ULL,
+                                                    blob + sizeof(header),
+                                                    header.size))
+            error = 2;
+    }
+
+    char *tmp = NULL;
+    if (!error)
+    {
+        tmp = cbuild_cache_tmp_path(cbuild_get_cache_dir());
+        if (!is_manifest && mkdir(tmp, 0755) == -1)
+            error = 1;
+    }
+    char *file = tmp ? malloc(strlen(tmp) + 32) : NULL;
+    for (size_t offset = sizeof(header); !error && offset < size; )
+    {
+        cbuild_remote_section section;
+        if (size - offset < sizeof(section))
+        {
+            error = 2;
+            break;
+        }
+        memcpy(&section, blob + offset, sizeof(section));
+        offset += sizeof(section);
+        if (section.size > size - offset
+                || memchr(section.name, '\0', sizeof(section.name)) == NULL
+                || strchr(section.name, '/') != NULL)
+        {
+            error = 2;
+            break;
+        }
+        if (is_manifest)
+            strcpy(file, tmp);
+        else
+            sprintf(file, "%s/%s", tmp, section.name);
+        error = cbuild_write_file(file, blob + offset, section.size,
+                                  section.mode & 0777);
+        offset += section.size;
+    }
+    if (!error)
+    {
+        cbuild_make_parent_directories(local);
+        // another thread, or process, may have fetched it meanwhile
+        error = rename(tmp, local) != 0 && stat(local, &st) != 0;
+    }
+    if (tmp != NULL && is_manifest)
+        remove(tmp);
+    else if (tmp != NULL)
+        cbuild_remove_directory(tmp);
+    if (error == 2)
+        remove(remote);
+
+    free(file);
+    free(tmp);
+    free(blob);
+    free(remote);
+    free(local);
+    return error;
+}
+
+void cbuild_remote_cache_run(cbuild_remote_job job)
+{
+    if (job.upload)
+        cbuild_remote_cache_store(job.key, job.suffix);
+    else
+        cbuild_remote_cache_fetch(job.key, job.suffix);
+}
+
+void *cbuild_remote_cache_worker(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&cbuild_remote.lock);
+    while (1)
+    {
+        while (cbuild_remote.head == cbuild_remote.size
+                && !cbuild_remote.stopping)
+            pthread_cond_wait(&cbuild_remote.cond, &cbuild_remote.lock);
+        if (cbuild_remote.head == cbuild_remote.size)
+            break;
+        cbuild_remote_job job = cbuild_remote.jobs[cbuild_remote.head++];
+        // once the build is over, there is nothing left to prefetch
+        if (!job.upload && cbuild_remote.stopping)
+            continue;
+        pthread_mutex_unlock(&cbuild_remote.lock);
+        cbuild_remote_cache_run(job);
+        pthread_mutex_lock(&cbuild_remote.lock);
+    }
+    pthread_mutex_unlock(&cbuild_remote.lock);
+    return NULL;
+}
+
+/**
+ * queues a transfer for one of the cbuild_remote_cache_jobs threads, started
+ * on the first transfer. It runs at once if no thread can be started
+ */
+void cbuild_remote_cache_submit(unsigned long long key, const char *suffix,
+        int upload)
+{
+    cbuild_remote_job job = { key, suffix, upload };
+    pthread_mutex_lock(&cbuild_remote.lock);
+    if (cbuild_remote.threads == NULL && cbuild_remote_cache_jobs > 0)
+    {
+        cbuild_remote.threads = malloc(cbuild_remote_cache_jobs
+                                       * sizeof(pthread_t));
+        for (unsigned i = 0; i < cbuild_remote_cache_jobs; i++)
+        {
+            if (pthread_create(&cbuild_remote.threads[cbuild_remote.nb_threads],
+                               NULL, cbuild_remote_cache_worker, NULL) == 0)
+                cbuild_remote.nb_threads += 1;
+        }
+    }
+    if (cbuild_remote.nb_threads == 0)
+    {
+        pthread_mutex_unlock(&cbuild_remote.lock);
+        cbuild_remote_cache_run(job);
+        return;
+    }
+    if (cbuild_remote.head == cbuild_remote.size)
+        cbuild_remote.head = cbuild_remote.size = 0;
+    if (cbuild_remote.size == cbuild_remote.capacity)
+    {
+        cbuild_remote.capacity = cbuild_remote.capacity
+            ? cbuild_remote.capacity * 2 : 64;
+        cbuild_remote.jobs = realloc(cbuild_remote.jobs, cbuild_remote.capacity
+                                     * sizeof(cbuild_remote_job));
+    }
+    cbuild_remote.jobs[cbuild_remote.size++] = job;
+    pthread_cond_signal(&cbuild_remote.cond);
+    pthread_mutex_unlock(&cbuild_remote.lock);
+}
+
+/**
+ * waits for the entries being stored in the remote cache, the pending
+ * prefetches being dropped
+ */
+void cbuild_remote_cache_wait(void)
+{
+    pthread_mutex_lock(&cbuild_remote.lock);
+    cbuild_remote.stopping = 1;
+    pthread_cond_broadcast(&cbuild_remote.cond);
+    pthread_mutex_unlock(&cbuild_remote.lock);
+    for (size_t i = 0; i < cbuild_remote.nb_threads; i++)
+        pthread_join(cbuild_remote.threads[i], NULL);
+    free(cbuild_remote.threads);
+    free(cbuild_remote.jobs);
+    cbuild_remote.threads = NULL;
+    cbuild_remote.jobs = NULL;
+    cbuild_remote.nb_threads = 0;
+    cbuild_remote.head = cbuild_remote.size = cbuild_remote.capacity = 0;
+    cbuild_remote.stopping = 0;
+}
+
+/**
+ * hashes a list of files and their content
+ */
+unsigned long long cbuild_hash_files(unsigned long long hash, char **files,
+        size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        unsigned long long file_hash = cbuild_get_file_hash(files[i]);
+        hash = cbuild_hash_bytes(hash, files[i], strlen(files[i]) + 1);
+        hash = cbuild_hash_bytes(hash, &file_hash, sizeof(file_hash));
+    }
+    return hash;
+}
+
+/**
+ * returns the key of a target without its discovered headers: its command and
+ * the content of its sources
+ */
+unsigned long long cbuild_target_action_key(cbuild_target *target)
+{
+    unsigned long long hash = cbuild_target_command_hash(target);
+    for (size_t i = 0; target->sources[i].source_type; i++)
+    {
+        char *file = (char *)cbuild_source_file(&target->sources[i]);
+        hash = cbuild_hash_files(hash, &file, 1);
+    }
+    return hash ? hash : 1;
+}
+
+/**
+ * returns the key of the entry of a target, 0 if it cannot be known or the
+ * target has no depfile: its manifest, keyed by its action key, lists the
+ * headers found during its last cached build. Unless fetch is set, a
+ * manifest missing locally is fetched by the remote cache threads
+ */
+unsigned long long cbuild_target_cache_key(cbuild_target *target, int fetch)
+{
+    if (target->depfile == NULL)
+        return 0;
+    unsigned long long key = cbuild_target_action_key(target);
+
+    if (fetch)
+        cbuild_remote_cache_fetch(key, ".deps");
+    char *path = cbuild_cache_path(key, ".deps");
+    FILE *manifest = fopen(path, "r");
+    free(path);
+    if (manifest == NULL && !fetch)
+        cbuild_remote_cache_submit(key, ".deps", 0);
+    if (manifest == NULL)
+        return 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, manifest) != -1)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        key = cbuild_hash_files(key, &line, 1);
+    }
+    free(line);
+    fclose(manifest);
+    return key ? key : 1;
+}
+
+/**
+ * writes the content of a file on a file descriptor
+ */
+void cbuild_replay_file(const char *file, int fd)
+{
+    int in = open(file, O_RDONLY);
+    if (in == -1)
+        return;
+    char buffer[65536];
+    ssize_t size;
+    while ((size = read(in, buffer, sizeof(buffer))) > 0)
+    {
+        if (write(fd, buffer, size) != size)
+            break;
+    }
+    close(in);
+}
+
+/**
+ * restores the output of a target from the cache, returns 0 on a hit
+ */
+int cbuild_cache_restore(cbuild_target *target)
+{
+    target->cache_key = 0;
+    if (cbuild_get_cache_dir() == NULL)
+        return 1;
+    target->cache_key = cbuild_target_cache_key(target, 1);
+    if (target->cache_key == 0)
+        return 1;
+
+    if (cbuild_remote_cache_fetch(target->cache_key, "") == 2)
+        cbuild_log(CBUILD_WARN, "Corrupted remote cache entry for `%s'",
+                   target->target_file);
+    char *entry = cbuild_cache_path(target->cache_key, "");
+    char *file = malloc(strlen(entry) + 16);
+    sprintf(file, "%s/output", entry);
+    int error = cbuild_copy_file(file, target->target_file);
+    cbuild_stat_invalidate(target->target_file);
+    if (!error && target->depfile != NULL)
+    {
+        sprintf(file, "%s/depfile", entry);
+        error = cbuild_copy_file(file, target->depfile);
+    }
+    if (!error)
+    {
+        cbuild_log(CBUILD_INFO, "Restored `%s' from the cache",
+                   target->target_file);
+        fflush(stdout);
+        sprintf(file, "%s/stdout", entry);
+        cbuild_replay_file(file, STDOUT_FILENO);
+        sprintf(file, "%s/stderr", entry);
+        cbuild_replay_file(file, STDERR_FILENO);
+        // the modification time of the entry is its last use
+        utimensat(AT_FDCWD, entry, NULL, 0);
+    }
+    free(file);
+    free(entry);
+    return error;
+}
+
+/**
+ * creates the temporary directory in which the output of a target and what
+ * its build printed are gathered, to become its cache entry if it succeeds
+ */
+void cbuild_cache_prepare(cbuild_target *target)
+{
+    target->cache_entry = NULL;
+    const char *dir = cbuild_get_cache_dir();
+    // see cbuild_cache_dir
+    if (dir == NULL || target->depfile == NULL)
+        return;
+    static unsigned counter = 0;
+    char *entry = malloc(strlen(dir) + 64);
+    sprintf(entry, "%s/tmp", dir);
+    cbuild_make_directories(entry);
+    sprintf(entry, "%s/tmp/%d-%u", dir, (int)getpid(), counter++);
+    if (mkdir(entry, 0755) == -1)
+    {
+        free(entry);
+        return;
+    }
+    target->cache_entry = entry;
+}
+
+/**
+ * returns the newly allocated path of a file of the entry being filled
+ */
+char *cbuild_cache_entry_file(cbuild_target *target, const char *name)
+{
+    char *path = malloc(strlen(target->cache_entry) + strlen(name) + 2);
+    sprintf(path, "%s/%s", target->cache_entry, name);
+    return path;
+}
+
+/**
+ * starts fetching the remote cache entry of a target about to be built, or
+ * its manifest if it is not known yet, while the targets before it in the
+ * ready queue run
+ */
+void cbuild_cache_prefetch(cbuild_target *target)
+{
+    if (cbuild_get_remote_cache_dir() == NULL || !cbuild_target_check(target))
+        return;
+    unsigned long long key = cbuild_target_cache_key(target, 0);
+    if (key != 0)
+        cbuild_remote_cache_submit(key, "", 0);
+}
+
+/**
+ * if the build of a target succeeded, moves its output and what it printed in
+ * the cache. The entry appears at once thanks to the rename
+ */
+void cbuild_cache_finish(cbuild_job *job, int success)
+{
+    cbuild_target *target = job->target;
+    if (target->cache_entry == NULL)
+        return;
+    char *out = cbuild_cache_entry_file(target, "stdout");
+    char *err = cbuild_cache_entry_file(target, "stderr");
+    if (success)
+        success = !cbuild_write_file(out, job->out.str, job->out.size, 0644)
+            && !cbuild_write_file(err, job->err.str, job->err.size, 0644);
+    free(out);
+    free(err);
+
+    unsigned long long key = target->cache_key;
+    if (success && target->depfile != NULL)
+    {
+        // the manifest lists the headers the command used this time
+        cbuild_str_vector *deps = cbuild_get_discovered_deps(target->target_file);
+        unsigned long long action_key = cbuild_target_action_key(target);
+        char *manifest = cbuild_cache_entry_file(target, "manifest");
+        FILE *file = fopen(manifest, "w");
+        key = action_key;
+        for (size_t i = 0; file && deps && i < deps->size; i++)
+            fprintf(file, "%s\n", deps->strs[i]);
+        if (deps != NULL)
+            key = cbuild_hash_files(key, deps->strs, deps->size);
+        key = key ? key : 1;
+        if (file == NULL || fclose(file) != 0)
+            key = 0;
+        char *path = cbuild_cache_path(action_key, ".deps");
+        if (key != 0)
+        {
+            cbuild_make_parent_directories(path);
+            if (rename(manifest, path) == 0
+                    && cbuild_get_remote_cache_dir() != NULL)
+                cbuild_remote_cache_submit(action_key, ".deps", 1);
+        }
+        free(path);
+        free(manifest);
+    }
+
+    if (success && key != 0)
+    {
+        char *output = cbuild_cache_entry_file(target, "output");
+        char *depfile = cbuild_cache_entry_file(target, "depfile");
+        char *entry = cbuild_cache_path(key, "");
+        int error = cbuild_copy_file(target->target_file, output)
+            || (target->depfile != NULL
+                && cbuild_copy_file(target->depfile, depfile));
+        if (!error)
+        {
+            cbuild_make_parent_directories(entry);
+            // another process may have stored the same entry meanwhile
+            if (rename(target->cache_entry, entry) == 0)
+            {
+                cbuild_cache_stored = 1;
+                if (cbuild_get_remote_cache_dir() != NULL)
+                    cbuild_remote_cache_submit(key, "", 1);
+            }
+        }
+        free(entry);
+        free(output);
+        free(depfile);
+    }
+    cbuild_remove_directory(target->cache_entry);
+    free(target->cache_entry);
+    target->cache_entry = NULL;
+}
+
+typedef struct {
+    char *path; ///< path of the entry
+    long long size; ///< size of the files of the entry
+    time_t last_use; ///< modification time of the entry
+} cbuild_cache_entry_info;
+
+int cbuild_cache_entry_info_cmp(const void *a, const void *b)
+{
+    const cbuild_cache_entry_info *e1 = a;
+    const cbuild_cache_entry_info *e2 = b;
+    return (e1->last_use > e2->last_use) - (e1->last_use < e2->last_use);
+}
+
+/**
+ * removes the least recently used entries when the cache is bigger than
+ * cbuild_cache_max_size, down to 90% of it
+ */
+void cbuild_cache_trim(void)
+{
+    if (!cbuild_cache_stored || cbuild_get_cache_dir() == NULL)
+        return;
+    cbuild_cache_stored = 0;
+
+    cbuild_cache_entry_info *entries = NULL;
+    size_t nb_entries = 0;
+    size_t capacity = 0;
+    unsigned long long total_size = 0;
+    const char *root = cbuild_get_cache_dir();
+    for (unsigned shard = 0; shard < 256; shard++)
+    {
+        char *shard_path = malloc(strlen(root) + 8);
+        sprintf(shard_path, "%s/%02x", root, shard);
+        DIR *dir = opendir(shard_path);
+        struct dirent *ent;
+        while (dir != NULL && (ent = readdir(dir)) != NULL)
+        {
+            if (ent->d_name[0] == '.')
+                continue;
+            char *path = malloc(strlen(shard_path) + strlen(ent->d_name) + 16);
+            sprintf(path, "%s/%s", shard_path, ent->d_name);
+            struct stat st;
+            if (stat(path, &st) == -1)
+            {
+                free(path);
+                continue;
+            }
+            cbuild_cache_entry_info info = {
+                .path = path, .size = st.st_size, .last_use = st.st_mtime
+            };
+            if (S_ISDIR(st.st_mode))
+            {
+                info.size = 0;
+                const char *names[] = { "output", "stdout", "stderr", "depfile" };
+                char *file = malloc(strlen(path) + 16);
+                for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++)
+                {
+                    sprintf(file, "%s/%s", path, names[i]);
+                    if (stat(file, &st) == 0)
+                        info.size += st.st_size;
+                }
+                free(file);
+            }
+            if (nb_entries == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 256;
+                entries = realloc(entries, capacity * sizeof(*entries));
+            }
+            entries[nb_entries++] = info;
+            total_size += info.size;
+        }
+        if (dir != NULL)
+            closedir(dir);
+        free(shard_path);
+    }
+
+    if (total_size > cbuild_cache_max_size)
+    {
+        qsort(entries, nb_entries, sizeof(*entries), cbuild_cache_entry_info_cmp);
+        for (size_t i = 0; i < nb_entries
+                && total_size > cbuild_cache_max_size / 10 * 9; i++)
+        {
+            if (remove(entries[i].path) == -1)
+                cbuild_remove_directory(entries[i].path);
+            total_size -= entries[i].size;
+        }
+    }
+    for (size_t i = 0; i < nb_entries; i++)
+        free(entries[i].path);
+    free(entries);
+}
+
+/*** jobserver impl ***/
+
+int cbuild_use_jobserver = 1;
+
+static struct {
+    int read_fd; ///< non blocking, -1 without jobserver
+    int write_fd;
+    int pipe[2]; ///< the pipe of the jobserver of cbuild, -1 if joined
+    cbuild_str_builder tokens; ///< the tokens taken, given back as they were
+    char *makeflags; ///< MAKEFLAGS before cbuild exported its jobserver
+    int exported;
+} cbuild_jobserver = { -1, -1, { -1, -1 }, { NULL, 0, 0, NULL }, NULL, 0 };
+
+/**
+ * returns a non blocking file descriptor reading the same pipe as fd, without
+ * changing the flags shared with the other processes of the jobserver. It is
+ * only a copy of fd if /proc is not available
+ */
+int cbuild_jobserver_reopen(int fd)
+{
+    char path[64];
+    sprintf(path, "/proc/self/fd/%d", fd);
+    int new_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    return new_fd == -1 ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : new_fd;
+}
+
+/**
+ * joins the jobserver given by MAKEFLAGS, either `fifo:PATH' or `R,W', or
+ * creates one with nb_process - 1 tokens, exported to the commands
+ */
+void cbuild_jobserver_setup(unsigned nb_process)
+{
+    if (!cbuild_use_jobserver)
+        return;
+    const char *flags = getenv("MAKEFLAGS");
+    const char *auth = NULL;
+    const char *prefixes[] = { "--jobserver-auth=", "--jobserver-fds=" };
+    for (size_t i = 0; flags != NULL && i < 2; i++)
+    {
+        // the last one is the one of the closest make
+        for (const char *it = flags; (it = strstr(it, prefixes[i])) != NULL;
+                it += strlen(prefixes[i]))
+            auth = it + strlen(prefixes[i]);
+        if (auth != NULL)
+            break;
+    }
+
+    int read_fd;
+    int write_fd;
+    if (auth != NULL && strncmp(auth, "fifo:", 5) == 0)
+    {
+        size_t size = strcspn(auth + 5, " ");
+        char *path = malloc(size + 1);
+        memcpy(path, auth + 5, size);
+        path[size] = '\0';
+        cbuild_jobserver.read_fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        cbuild_jobserver.write_fd = cbuild_jobserver.read_fd;
+        free(path);
+    }
+    // make closes the pipe for the commands it does not know to be recursive
+    else if (auth != NULL && sscanf(auth, "%d,%d", &read_fd, &write_fd) == 2
+            && fcntl(read_fd, F_GETFD) != -1 && fcntl(write_fd, F_GETFD) != -1)
+    {
+        cbuild_jobserver.read_fd = cbuild_jobserver_reopen(read_fd);
+        cbuild_jobserver.write_fd = write_fd;
+    }
+    if (cbuild_jobserver.read_fd != -1 || nb_process <= 1
+            || pipe(cbuild_jobserver.pipe) == -1)
+        return;
+
+    // the pipe is used as a counter, one byte per token
+    for (unsigned i = 1; i < nb_process; i++)
+    {
+        if (write(cbuild_jobserver.pipe[1], "+", 1) != 1)
+            break;
+    }
+    cbuild_jobserver.read_fd = cbuild_jobserver_reopen(cbuild_jobserver.pipe[0]);
+    cbuild_jobserver.write_fd = cbuild_jobserver.pipe[1];
+    // the pipe form is the one understood by all the versions of make
+    const char *old = getenv("MAKEFLAGS");
+    cbuild_jobserver.makeflags = old ? strdup(old) : NULL;
+    // the variables of the command line of make come last, after a `--'
+    const char *variables = NULL;
+    if (old != NULL)
+        variables = strncmp(old, "-- ", 3) == 0 ? old : strstr(old, " -- ");
+    int flags_size = old == NULL ? 0
+        : variables != NULL ? (int)(variables - old) : (int)strlen(old);
+    if (variables != NULL && *variables == ' ')
+        variables++;
+    char *makeflags = malloc((old ? strlen(old) : 0) + 64);
+    sprintf(makeflags, "%.*s -j%u --jobserver-auth=%d,%d%s%s", flags_size,
+            old ? old : "", nb_process, cbuild_jobserver.pipe[0],
+            cbuild_jobserver.pipe[1], variables ? " " : "",
+            variables ? variables : "");
+    setenv("MAKEFLAGS", makeflags, 1);
+    free(makeflags);
+    cbuild_jobserver.exported = 1;
+}
+
+/**
+ * takes a token of the jobserver without blocking, returns 1 if it did or if
+ * there is no jobserver
+ */
+int cbuild_jobserver_acquire(void)
+{
+    if (cbuild_jobserver.read_fd == -1)
+        return 1;
+    // the fd may be blocking if it could not be reopened
+    struct pollfd fd = { cbuild_jobserver.read_fd, POLLIN, 0 };
+    char token;
+    if (poll(&fd, 1, 0) != 1 || read(cbuild_jobserver.read_fd, &token, 1) != 1)
+        return 0;
+    cbuild_str_builder_append_char(&cbuild_jobserver.tokens, token);
+    return 1;
+}
+
+/**
+ * gives a token back to the jobserver
+ */
+void cbuild_jobserver_release(void)
+{
+    if (cbuild_jobserver.tokens.size == 0)
+        return;
+    char token = cbuild_jobserver.tokens.str[--cbuild_jobserver.tokens.size];
+    while (write(cbuild_jobserver.write_fd, &token, 1) == -1 && errno == EINTR)
+        continue;
+}
+
+/**
+ * gives the tokens back and stops exporting the jobserver of cbuild
+ */
+void cbuild_jobserver_cleanup(void)
+{
+    while (cbuild_jobserver.tokens.size > 0)
+        cbuild_jobserver_release();
+    free(cbuild_jobserver.tokens.str);
+    cbuild_jobserver.tokens = (cbuild_str_builder){ NULL, 0, 0, NULL };
+    if (cbuild_jobserver.exported)
+    {
+        if (cbuild_jobserver.makeflags != NULL)
+            setenv("MAKEFLAGS", cbuild_jobserver.makeflags, 1);
+        else
+            unsetenv("MAKEFLAGS");
+        free(cbuild_jobserver.makeflags);
+        cbuild_jobserver.makeflags = NULL;
+        cbuild_jobserver.exported = 0;
+    }
+    // the write end of a joined pipe belongs to make
+    int fds[] = { cbuild_jobserver.read_fd, cbuild_jobserver.pipe[0],
+                  cbuild_jobserver.pipe[1] };
+    for (size_t i = 0; i < 3; i++)
+    {
+        if (fds[i] != -1)
+            close(fds[i]);
+    }
+    cbuild_jobserver.read_fd = cbuild_jobserver.write_fd = -1;
+    cbuild_jobserver.pipe[0] = cbuild_jobserver.pipe[1] = -1;
+}
+
+/*** cpus impl ***/
+
+/**
+ * returns the number of CPUs the cgroup v2 quotas of cbuild and of its parent
+ * cgroups allow, 0 if there is none
+ */
+unsigned cbuild_cgroup_cpus(void)
+{
+    char line[4096] = { 0 };
+    FILE *file = fopen("/proc/self/cgroup", "r");
+    int found = 0;
+    while (file != NULL && !found && fgets(line, sizeof(line), file) != NULL)
+        found = strncmp(line, "0::", 3) == 0;
+    if (file != NULL)
+        fclose(file);
+    if (!found)
+        return 0;
+    char *cgroup = line + 3;
+    cgroup[strcspn(cgroup, "\n")] = '\0';
+
+    unsigned cpus = 0;
+    const char *mounts[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+    char *path = malloc(strlen(cgroup) + 64);
+    for (size_t i = 0; i < 2; i++)
+    {
+        // the quota of a parent cgroup applies to its children
+        for (char *end = cgroup + strlen(cgroup); end != NULL; )
+        {
+            sprintf(path, "%s%.*s/cpu.max", mounts[i], (int)(end - cgroup),
+                    cgroup);
+            long long quota = 0;
+            long long period = 0;
+            file = fopen(path, "r");
+            if (file != NULL && fscanf(file, "%lld %lld", &quota, &period) == 2
+                    && quota > 0 && period > 0)
+            {
+                unsigned quota_cpus = (quota + period - 1) / period;
+                if (cpus == 0 || quota_cpus < cpus)
+                    cpus = quota_cpus;
+            }
+            if (file != NULL)
+                fclose(file);
+            if (end == cgroup)
+                break;
+            while (end > cgroup && *--end != '/')
+                continue;
+        }
+    }
+    free(path);
+    return cpus;
+}
+
+unsigned cbuild_available_cpus(void)
+{
+    static unsigned cpus = 0;
+    if (cpus != 0)
+        return cpus;
+
+#ifdef SYS_sched_getaffinity
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+    long size = syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask);
+    for (long i = 0; i < size / (long)sizeof(unsigned long); i++)
+    {
+        for (unsigned long bits = mask[i]; bits != 0; bits &= bits - 1)
+            cpus += 1;
+    }
+#endif /* SYS_sched_getaffinity */
+    if (cpus == 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        cpus = online > 0 ? online : 1;
+    }
+    unsigned quota_cpus = cbuild_cgroup_cpus();
+    if (quota_cpus != 0 && quota_cpus < cpus)
+        cpus = quota_cpus;
+    return cpus;
+}
+
+/*** admission impl ***/
+
+double cbuild_max_load = 0;
+double cbuild_max_memory_pressure = 0;
+unsigned long long cbuild_min_available_memory = 0;
+double cbuild_throttled_time = 0;
+
+/**
+ * returns the value of a field of a /proc file whose lines start with its name,
+ * such as `MemAvailable:' in /proc/meminfo or `some' in /proc/pressure/memory
+ */
+int cbuild_read_proc_field(const char *path, const char *name,
+        const char *format, void *value)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return 1;
+    char line[256];
+    int error = 1;
+    while (error && fgets(line, sizeof(line), file) != NULL)
+    {
+        if (strncmp(line, name, strlen(name)) == 0)
+            error = sscanf(line + strlen(name), format, value) != 1;
+    }
+    fclose(file);
+    return error;
+}
+
+/**
+ * checks whether the host is too busy to start a new job, according to
+ * cbuild_max_load, cbuild_max_memory_pressure and cbuild_min_available_memory.
+ * The answer is kept for half a second not to read /proc for each job
+ */
+int cbuild_admission_throttled(void)
+{
+    static double last_check = 0;
+    static int throttled = 0;
+    double now = cbuild_get_time();
+    if (last_check != 0 && now - last_check < 0.5)
+        return throttled;
+    last_check = now;
+    throttled = 0;
+
+    double load;
+    if (cbuild_max_load > 0 && getloadavg(&load, 1) == 1)
+        throttled |= load > cbuild_max_load;
+    double pressure;
+    if (cbuild_max_memory_pressure > 0
+            && cbuild_read_proc_field("/proc/pressure/memory", "some",
+                                      " avg10=%lf", &pressure) == 0)
+        throttled |= pressure > cbuild_max_memory_pressure;
+    unsigned long long available;
+    if (cbuild_min_available_memory > 0
+            && cbuild_read_proc_field("/proc/meminfo", "MemAvailable:",
+                                      " %llu", &available) == 0)
+        throttled |= available / 1024 < cbuild_min_available_memory;
+    return throttled;
+}
+
+/*** trace impl ***/
+
+const char *cbuild_trace_file = NULL;
+
+static struct {
+    int enabled;
+    double start; ///< start of the build, the origin of the timestamps
+    cbuild_str_builder events;
+} cbuild_trace;
+
+const char *cbuild_get_trace_file(void)
+{
+    const char *file = cbuild_trace_file;
+#if CBUILD_ENABLE_CARGPARSE
+    if (file == NULL)
+        file = trace;
+#endif /* CBUILD_ENABLE_CARGPARSE */
+    if (file == NULL)
+        file = getenv("CBUILD_TRACE");
+    return file;
+}
+
+/**
+ * appends a string as a JSON string literal
+ */
+void cbuild_str_builder_append_json(cbuild_str_builder *sb, const char *str)
+{
+    cbuild_str_builder_append_char(sb, '"');
+    for (; *str != '\0'; str++)
+    {
+        char escaped[8];
+        if (*str == '"' || *str == '\\')
+            sprintf(escaped, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            sprintf(escaped, "\\u%04x", *str);
+        else
+        {
+            cbuild_str_builder_append_char(sb, *str);
+            continue;
+        }
+        cbuild_str_builder_append_cstr(sb, escaped);
+    }
+    cbuild_str_builder_append_char(sb, '"');
+}
+
+/**
+ * starts the trace of a build, if there is a file to write it in
+ */
+void cbuild_trace_begin(void)
+{
+    cbuild_trace.enabled = cbuild_get_trace_file() != NULL;
+    cbuild_trace.start = cbuild_get_time();
+    cbuild_trace.events.size = 0;
+}
+
+/**
+ * adds a span to a track of the trace, track 0 being the scheduler and the
+ * next ones the slots of the jobs. args is a list of names and values ending
+ * with NULL, NULL itself if there are none
+ */
+void cbuild_trace_span(const char *name, unsigned track, double start,
+        double end, const char **args)
+{
+    if (!cbuild_trace.enabled)
+        return;
+    cbuild_str_builder *sb = &cbuild_trace.events;
+    char buffer[128];
+    cbuild_str_builder_append_cstr(sb, ",\n{\"name\":");
+    cbuild_str_builder_append_json(sb, name);
+    sprintf(buffer, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+            "\"dur\":%.3f", track, (start - cbuild_trace.start) * 1e6,
+            (end - start) * 1e6);
+    cbuild_str_builder_append_cstr(sb, buffer);
+    for (size_t i = 0; args != NULL && args[i] != NULL; i += 2)
+    {
+        cbuild_str_builder_append_cstr(sb, i == 0 ? ",\"args\":{" : ",");
+        cbuild_str_builder_append_json(sb, args[i]);
+        cbuild_str_builder_append_char(sb, ':');
+        cbuild_str_builder_append_json(sb, args[i + 1]);
+    }
+    cbuild_str_builder_append_cstr(sb, args != NULL && args[0] != NULL ? "}}"
+                                                                       : "}");
+}
+
+/**
+ * adds the span of a job that finished, wstatus being its status as returned
+ * by waitpid
+ */
+void cbuild_trace_job(cbuild_job *job, int wstatus)
+{
+    if (!cbuild_trace.enabled)
+        return;
+    char status[32];
+    if (job->pid == -1)
+        strcpy(status, "not started");
+    else if (WIFSIGNALED(wstatus))
+        sprintf(status, "signal %d", WTERMSIG(wstatus));
+    else
+        sprintf(status, "exit %d", WEXITSTATUS(wstatus));
+    const char *args[] = {
+        "command", job->command != NULL ? job->command : "", "status", status,
+        NULL
+    };
+    cbuild_trace_span(job->target->target_file, job->slot + 1,
+                      job->target->start_time, cbuild_get_time(), args);
+}
+
+/**
+ * writes the trace of a build, with the names of its tracks
+ */
+void cbuild_trace_end(unsigned nb_slots)
+{
+    if (!cbuild_trace.enabled)
+        return;
+    cbuild_trace.enabled = 0;
+    const char *path = cbuild_get_trace_file();
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        cbuild_log(CBUILD_WARN, "Could not write the trace in %s: %s", path,
+                   strerror(errno));
+        return;
+    }
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"args\":{\"name\":\"cbuild\"}}");
+    for (unsigned track = 0; track <= nb_slots; track++)
+    {
+        char name[32];
+        if (track == 0)
+            strcpy(name, "scheduler");
+        else
+            sprintf(name, "slot %u", track - 1);
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%u,\"args\":{\"name\":\"%s\"}}", track, name);
+        fprintf(file, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\","
+                "\"pid\":1,\"tid\":%u,\"args\":{\"sort_index\":%u}}",
+                track, track);
+    }
+    fwrite(cbuild_trace.events.str, 1, cbuild_trace.events.size, file);
+    fprintf(file, "\n]}\n");
+    if (fclose(file) != 0)
+        cbuild_log(CBUILD_WARN, "Could not write the trace in %s", path);
+}
+
+/*** explain impl ***/
+
+int cbuild_explain = 0;
+const char *cbuild_explain_file = NULL;
+
+static cbuild_str_builder cbuild_explanations = { 0 };
+
+const char *cbuild_get_explain_file(void)
+{
+    return cbuild_explain_file != NULL ? cbuild_explain_file
+                                       : getenv("CBUILD_EXPLAIN_FILE");
+}
+
+/**
+ * prints why a target is rebuilt and adds it to the explanations written in
+ * the explain file
+ */
+void cbuild_explain_target(cbuild_target *target)
+{
+    int print = cbuild_explain;
+#if CBUILD_ENABLE_CARGPARSE
+    print |= explain;
+#endif /* CBUILD_ENABLE_CARGPARSE */
+    if (!print && cbuild_get_explain_file() == NULL)
+        return;
+
+    static const char *names[] = {
+        [CBUILD_CAUSE_NONE] = "none",
+        [CBUILD_CAUSE_ALWAYS_RECOMPILE] = "always_recompile",
+        [CBUILD_CAUSE_COMMAND_CHANGED] = "command_changed",
+        [CBUILD_CAUSE_UNKNOWN_HEADERS] = "unknown_headers",
+        [CBUILD_CAUSE_MISSING_OUTPUT] = "missing_output",
+        [CBUILD_CAUSE_NEWER_SOURCE] = "newer_source",
+        [CBUILD_CAUSE_MISSING_SOURCE] = "missing_source",
+        [CBUILD_CAUSE_REBUILT_SOURCE] = "rebuilt_source",
+        [CBUILD_CAUSE_EARLIER_BUILD] = "earlier_build",
+        [CBUILD_CAUSE_INPUTS_CHANGED] = "inputs_changed",
+    };
+    static const char *descriptions[] = {
+        [CBUILD_CAUSE_NONE] = "up to date",
+        [CBUILD_CAUSE_ALWAYS_RECOMPILE] = "all the targets are rebuilt",
+        [CBUILD_CAUSE_COMMAND_CHANGED] = "its command changed",
+        [CBUILD_CAUSE_UNKNOWN_HEADERS] = "its headers are unknown",
+        [CBUILD_CAUSE_MISSING_OUTPUT] = "it does not exist",
+        [CBUILD_CAUSE_NEWER_SOURCE] = "a source is newer",
+        [CBUILD_CAUSE_MISSING_SOURCE] = "a header no longer exists",
+        [CBUILD_CAUSE_REBUILT_SOURCE] = "a source was rebuilt",
+        [CBUILD_CAUSE_EARLIER_BUILD] = "a target built before it was rebuilt",
+        [CBUILD_CAUSE_INPUTS_CHANGED] = "the content of its sources changed",
+    };
+    cbuild_rebuild_cause *cause = &target->cause;
+    char source_time[32];
+    char target_time[32];
+    sprintf(source_time, "%lld.%09lld", cause->source_mtime / 1000000000LL,
+            cause->source_mtime % 1000000000LL);
+    sprintf(target_time, "%lld.%09lld", cause->target_mtime / 1000000000LL,
+            cause->target_mtime % 1000000000LL);
+    if (print && cause->kind == CBUILD_CAUSE_NEWER_SOURCE)
+        cbuild_log(CBUILD_INFO, "Rebuilding `%s': `%s' (%s) is newer than it "
+                   "(%s)", target->target_file, cause->file, source_time,
+                   target_time);
+    else if (print && cause->file != NULL)
+        cbuild_log(CBUILD_INFO, "Rebuilding `%s': %s (`%s')",
+                   target->target_file, descriptions[cause->kind], cause->file);
+    else if (print)
+        cbuild_log(CBUILD_INFO, "Rebuilding `%s': %s", target->target_file,
+                   descriptions[cause->kind]);
+
+    cbuild_str_builder *sb = &cbuild_explanations;
+    cbuild_str_builder_append_cstr(sb, sb->size == 0 ? "[\n{\"target\":"
+                                                     : ",\n{\"target\":");
+    cbuild_str_builder_append_json(sb, target->target_file);
+    cbuild_str_builder_append_cstr(sb, ",\"cause\":");
+    cbuild_str_builder_append_json(sb, names[cause->kind]);
+    if (cause->file != NULL)
+    {
+        cbuild_str_builder_append_cstr(sb, ",\"file\":");
+        cbuild_str_builder_append_json(sb, cause->file);
+    }
+    char buffer[64];
+    if (cause->source_mtime != 0)
+    {
+        sprintf(buffer, ",\"file_mtime_ns\":%lld", cause->source_mtime);
+        cbuild_str_builder_append_cstr(sb, buffer);
+    }
+    if (cause->target_mtime != 0)
+    {
+        sprintf(buffer, ",\"target_mtime_ns\":%lld", cause->target_mtime);
+        cbuild_str_builder_append_cstr(sb, buffer);
+    }
+    cbuild_str_builder_append_char(sb, '}');
+}
+
+/**
+ * writes the explanations of a build in the explain file
+ */
+void cbuild_explain_end(void)
+{
+    const char *path = cbuild_get_explain_file();
+    if (path == NULL)
+        return;
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        cbuild_log(CBUILD_WARN, "Could not write the explanations in %s: %s",
+                   path, strerror(errno));
+        cbuild_explanations.size = 0;
+        return;
+    }
+    if (cbuild_explanations.size == 0)
+        fprintf(file, "[]\n");
+    else
+    {
+        fwrite(cbuild_explanations.str, 1, cbuild_explanations.size, file);
+        fprintf(file, "\n]\n");
+    }
+    if (fclose(file) != 0)
+        cbuild_log(CBUILD_WARN, "Could not write the explanations in %s",
+                   path);
+    cbuild_explanations.size = 0;
+}
+
+/*** usage impl ***/
+
+unsigned cbuild_usage_summary_size = 5;
+
+/**
+ * resources used by the command of a target, and by its previous build
+ */
+typedef struct {
+    cbuild_target *target;
+    double cpu_time;
+    double previous_cpu_time;
+    long long max_rss;
+    long long previous_max_rss;
+} cbuild_usage;
+
+static struct {
+    cbuild_usage *usages;
+    size_t size;
+    size_t capacity;
+} cbuild_usages = { 0 };
+
+/**
+ * records the resources used by the command of a job, as returned by wait4
+ */
+void cbuild_usage_record(cbuild_job *job, const struct rusage *rusage)
+{
+    cbuild_target_record *record = job->target->record;
+    cbuild_usage usage = {
+        .target = job->target,
+        .previous_cpu_time = record->user_time + record->system_time,
+        .previous_max_rss = record->max_rss,
+    };
+    record->user_time = rusage->ru_utime.tv_sec
+        + rusage->ru_utime.tv_usec / 1e6;
+    record->system_time = rusage->ru_stime.tv_sec
+        + rusage->ru_stime.tv_usec / 1e6;
+    record->max_rss = rusage->ru_maxrss;
+    usage.cpu_time = record->user_time + record->system_time;
+    usage.max_rss = record->max_rss;
+    if (cbuild_usages.size == cbuild_usages.capacity)
+    {
+        cbuild_usages.capacity = cbuild_usages.capacity
+            ? cbuild_usages.capacity * 2 : 64;
+        cbuild_usages.usages = realloc(cbuild_usages.usages,
+                cbuild_usages.capacity * sizeof(cbuild_usage));
+    }
+    cbuild_usages.usages[cbuild_usages.size++] = usage;
+}
+
+int cbuild_usage_compare_cpu_time(const void *a, const void *b)
+{
+    const cbuild_usage *first = a;
+    const cbuild_usage *second = b;
+    return (first->cpu_time < second->cpu_time)
+        - (first->cpu_time > second->cpu_time);
+}
+
+int cbuild_usage_compare_max_rss(const void *a, const void *b)
+{
+    const cbuild_usage *first = a;
+    const cbuild_usage *second = b;
+    return (first->max_rss < second->max_rss)
+        - (first->max_rss > second->max_rss);
+}
+
+/**
+ * formats the change of a value since the previous build, nothing if it is
+ * unknown
+ */
+void cbuild_usage_format_change(char *buffer, double value, double previous)
+{
+    buffer[0] = '\0';
+    if (previous > 0)
+        sprintf(buffer, " (%+.0f%%)", (value - previous) * 100 / previous);
+}
+
+/**
+ * lists the targets whose commands used the most CPU time and memory during
+ * the build
+ */
+void cbuild_report_usage(void)
+{
+    size_t size = cbuild_usages.size;
+    if (size > cbuild_usage_summary_size)
+        size = cbuild_usage_summary_size;
+    if (size == 0)
+    {
+        cbuild_usages.size = 0;
+        return;
+    }
+    char change[32];
+    qsort(cbuild_usages.usages, cbuild_usages.size, sizeof(cbuild_usage),
+          cbuild_usage_compare_cpu_time);
+    cbuild_log(CBUILD_INFO, "Most CPU time:");
+    for (size_t i = 0; i < size; i++)
+    {
+        cbuild_usage *usage = &cbuild_usages.usages[i];
+        cbuild_target_record *record = usage->target->record;
+        cbuild_usage_format_change(change, usage->cpu_time,
+                                   usage->previous_cpu_time);
+        cbuild_log(CBUILD_INFO, "  %8.2fs%-7s user %.2fs, system %.2fs, "
+                   "wall %.2fs: %s", usage->cpu_time, change,
+                   record->user_time, record->system_time, record->duration,
+                   usage->target->target_file);
+    }
+    qsort(cbuild_usages.usages, cbuild_usages.size, sizeof(cbuild_usage),
+          cbuild_usage_compare_max_rss);
+    cbuild_log(CBUILD_INFO, "Most memory:");
+    for (size_t i = 0; i < size; i++)
+    {
+        cbuild_usage *usage = &cbuild_usages.usages[i];
+        cbuild_usage_format_change(change, usage->max_rss,
+                                   usage->previous_max_rss);
+        cbuild_log(CBUILD_INFO, "  %7.1fMiB%-7s %s", usage->max_rss / 1024.,
+                   change, usage->target->target_file);
+    }
+    cbuild_usages.size = 0;
+}
+
+/*** failures impl ***/
+
+int cbuild_keep_going = 0;
+
+static cbuild_target_vector cbuild_failed_targets = { 0 };
+static volatile sig_atomic_t cbuild_interrupted = 0;
+/// written by the signal handler, to wake up the build wherever it waits
+static int cbuild_interrupt_pipe[2] = { -1, -1 };
+
+int cbuild_should_keep_going(void)
+{
+    int keep = cbuild_keep_going;
+#if CBUILD_ENABLE_CARGPARSE
+    keep |= keep_going;
+#endif /* CBUILD_ENABLE_CARGPARSE */
+    return keep && !cbuild_interrupted;
+}
+
+void cbuild_target_failed(cbuild_target *target)
+{
+    target->state = CBUILD_TARGET_FAILED;
+    cbuild_target_vector_add_target(&cbuild_failed_targets, target);
+}
+
+/**
+ * logs the targets which failed, and those which were not built because they
+ * depend on them, and forgets them
+ */
+void cbuild_report_failures(size_t nb_skipped)
+{
+    for (size_t i = 0; i < cbuild_failed_targets.size; i++)
+        cbuild_log(CBUILD_ERROR, "Could not build `%s'",
+                   cbuild_failed_targets.targets[i]->target_file);
+    if (nb_skipped > 0)
+        cbuild_log(CBUILD_ERROR, "%zu targets not built because of failures",
+                   nb_skipped);
+    cbuild_failed_targets.size = 0;
+}
+
+void cbuild_interrupt_handler(int signal)
+{
+    int saved_errno = errno;
+    cbuild_interrupted = signal;
+    if (cbuild_interrupt_pipe[1] != -1)
+    {
+        // full when it was already written
+        ssize_t size = write(cbuild_interrupt_pipe[1], "", 1);
+        (void)size;
+    }
+    errno = saved_errno;
+}
+
+/**
+ * catches SIGINT and SIGTERM during a build: the commands have their own
+ * process groups, so they must be stopped by cbuild. The signals also make
+ * cbuild_interrupt_pipe readable, so that waiting for the jobs cannot miss
+ * one received just before. Once the build is over, the previous handlers are
+ * restored and the signal raised again
+ */
+void cbuild_catch_interrupts(int catch)
+{
+    static struct sigaction old_actions[2];
+    int signals[] = { SIGINT, SIGTERM };
+    if (catch)
+    {
+        cbuild_interrupted = 0;
+        if (pipe(cbuild_interrupt_pipe) == -1)
+            cbuild_interrupt_pipe[0] = cbuild_interrupt_pipe[1] = -1;
+        for (size_t i = 0; i < 2 && cbuild_interrupt_pipe[i] != -1; i++)
+        {
+            fcntl(cbuild_interrupt_pipe[i], F_SETFD, FD_CLOEXEC);
+            fcntl(cbuild_interrupt_pipe[i], F_SETFL, O_NONBLOCK);
+        }
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = cbuild_interrupt_handler;
+        sigemptyset(&action.sa_mask);
+        for (size_t i = 0; i < 2; i++)
+        {
+            sigaction(signals[i], &action, &old_actions[i]);
+            // such as SIGINT for the background jobs of a shell
+            if (old_actions[i].sa_handler == SIG_IGN)
+                sigaction(signals[i], &old_actions[i], NULL);
+        }
+        return;
+    }
+    for (size_t i = 0; i < 2; i++)
+    {
+        sigaction(signals[i], &old_actions[i], NULL);
+        if (cbuild_interrupt_pipe[i] != -1)
+            close(cbuild_interrupt_pipe[i]);
+        cbuild_interrupt_pipe[i] = -1;
+    }
+    if (cbuild_interrupted)
+        raise(cbuild_interrupted);
+}
+
+/*** jobs impl ***/
+
+int cbuild_job_start(cbuild_job *job, cbuild_target *target)
+{
+    cbuild_command build_command = cbuild_target_build_command(target);
+    int out[2];
+    int err[2];
+    if (pipe(out) == -1)
+        return 1;
+    if (pipe(err) == -1)
+    {
+        close(out[0]);
+        close(out[1]);
+        return 1;
+    }
+    // only the ends given to the command must be inherited
+    int fds[] = { out[0], out[1], err[0], err[1] };
+    for (size_t i = 0; i < 4; i++)
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    fcntl(err[0], F_SETFL, O_NONBLOCK);
+
+    job->target = target;
+    job->out_fd = out[0];
+    job->err_fd = err[0];
+    job->pidfd = -1;
+    target->start_time = cbuild_get_time();
+    if (cbuild_trace.enabled)
+        job->command = cbuild_str_vector_join(&build_command.argv, " ");
+    cbuild_cache_prepare(target);
+    job->pid = __cbuild_command_exec_async(&build_command, out[1], err[1], 1);
+    close(out[1]);
+    close(err[1]);
+    if (job->pid == -1)
+    {
+        cbuild_job_finish(job);
+        return 1;
+    }
+#ifdef SYS_pidfd_open
+    job->pidfd = syscall(SYS_pidfd_open, job->pid, 0);
+#endif /* SYS_pidfd_open */
+    return 0;
+}
+
+void cbuild_job_read(cbuild_job *job, int fd)
+{
+    cbuild_str_builder *output = fd == job->out_fd ? &job->out : &job->err;
+    char buffer[65536];
+    ssize_t size;
+    while ((size = read(fd, buffer, sizeof(buffer))) != 0)
+    {
+        if (size > 0)
+            cbuild_str_builder_append_data(output, buffer, size);
+        else if (errno != EINTR)
+            break;
+    }
+    if (size == 0 || errno != EAGAIN)
+    {
+        close(fd);
+        if (fd == job->out_fd)
+            job->out_fd = -1;
+        else
+            job->err_fd = -1;
+    }
+}
+
+/**
+ * reads what a job prints until it closes its pipes or cbuild is interrupted,
+ * for the synchronous build
+ */
+void cbuild_job_drain(cbuild_job *job)
+{
+    while ((job->out_fd != -1 || job->err_fd != -1) && !cbuild_interrupted)
+    {
+        struct pollfd fds[] = {
+            { job->out_fd, POLLIN, 0 }, { job->err_fd, POLLIN, 0 },
+            { cbuild_interrupt_pipe[0], POLLIN, 0 }
+        };
+        if (poll(fds, 3, -1) == -1 && errno != EINTR)
+            break;
+        for (size_t i = 0; i < 2; i++)
+        {
+            if (fds[i].fd != -1 && fds[i].revents != 0)
+                cbuild_job_read(job, fds[i].fd);
+        }
+    }
+}
+
+void cbuild_write_all(int fd, const char *data, size_t size)
+{
+    ssize_t size_written;
+    while (size > 0 && ((size_written = write(fd, data, size)) > 0
+                        || errno == EINTR))
+    {
+        if (size_written > 0)
+        {
+            data += size_written;
+            size -= size_written;
+        }
+    }
+}
+
+int cbuild_job_finish(cbuild_job *job)
+{
+    cbuild_target *target = job->target;
+    int wstatus = 0;
+    struct rusage usage;
+    pid_t pid = -1;
+    while (job->pid != -1
+            && (pid = wait4(job->pid, &wstatus, 0, &usage)) == -1
+            && errno == EINTR)
+        continue;
+    int error = job->pid == -1 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus);
+    cbuild_trace_job(job, wstatus);
+    // failed and cancelled commands would skew the usage of the target
+    if (pid != -1 && !error)
+        cbuild_usage_record(job, &usage);
+    // what is left in the pipes, the processes the command may have left
+    // behind keeping them open
+    int fds[] = { job->out_fd, job->err_fd, job->pidfd };
+    for (size_t i = 0; i < 2; i++)
+    {
+        if (fds[i] != -1)
+            cbuild_job_read(job, fds[i]);
+    }
+    for (size_t i = 0; i < 3; i++)
+    {
+        if (fds[i] != -1)
+            close(fds[i]);
+    }
+
+    fflush(stdout);
+    cbuild_write_all(STDOUT_FILENO, job->out.str, job->out.size);
+    cbuild_write_all(STDERR_FILENO, job->err.str, job->err.size);
+    cbuild_stat_invalidate(target->target_file);
+    if (!error)
+    {
+        target->record->duration = cbuild_get_time() - target->start_time;
+        cbuild_target_built(target);
+    }
+    cbuild_cache_finish(job, !error);
+
+    free(job->out.str);
+    free(job->err.str);
+    free(job->command);
+    memset(job, 0, sizeof(*job));
+    return error;
+}
+
+/**
+ * stops running jobs: their process groups get SIGTERM, then SIGKILL if they
+ * did not exit within a second. The outputs they may have partially written
+ * are removed, unless their command succeeded before being stopped
+ */
+void cbuild_jobs_cancel(cbuild_job *jobs, size_t nb_jobs)
+{
+    for (size_t i = 0; i < nb_jobs; i++)
+    {
+        if (jobs[i].target != NULL)
+            kill(-jobs[i].pid, SIGTERM);
+    }
+    double deadline = cbuild_get_time() + 1;
+    for (size_t i = 0; i < nb_jobs; i++)
+    {
+        while (jobs[i].target != NULL)
+        {
+            siginfo_t info;
+            memset(&info, 0, sizeof(info));
+            if (waitid(P_PID, jobs[i].pid, &info,
+                       WEXITED | WNOHANG | WNOWAIT) == -1 || info.si_pid != 0)
+                break;
+            if (cbuild_get_time() > deadline)
+            {
+                kill(-jobs[i].pid, SIGKILL);
+                break;
+            }
+            struct timespec delay = { 0, 10000000 };
+            nanosleep(&delay, NULL);
+        }
+        if (jobs[i].target == NULL)
+            continue;
+        char *file = jobs[i].target->target_file;
+        if (cbuild_job_finish(&jobs[i]) != 0)
+        {
+            remove(file);
+            cbuild_stat_invalidate(file);
+        }
+    }
+}
+
+/**
+ * files stated by a prefetch thread: the entries from start, step by step
+ */
+typedef struct {
+    cbuild_stat_entry **entries;
+    size_t nb_entries;
+    size_t start;
+    size_t step;
+} cbuild_stat_prefetch_work;
+
+void *cbuild_stat_prefetch_thread(void *data)
+{
+    cbuild_stat_prefetch_work *work = data;
+    for (size_t i = work->start; i < work->nb_entries; i += work->step)
+        cbuild_stat_entry_fill(work->entries[i]);
+    return NULL;
+}
+
+/**
+ * files to state before a build
+ */
+typedef struct {
+    cbuild_stat_entry **entries;
+    size_t size;
+    size_t capacity;
+} cbuild_stat_prefetch_list;
+
+void cbuild_stat_prefetch_add(cbuild_stat_prefetch_list *list,
+        const char *file)
+{
+    cbuild_stat_entry *entry = cbuild_stat_entry_get(file);
+    // marked valid right away so that it is listed once, it is filled before
+    // the build reads it
+    if (entry->valid)
+        return;
+    entry->valid = 1;
+    if (list->size == list->capacity)
+    {
+        list->capacity = list->capacity ? list->capacity * 2 : 256;
+        list->entries = realloc(list->entries,
+                                list->capacity * sizeof(*list->entries));
+    }
+    list->entries[list->size++] = entry;
+}
+
+/**
+ * lists the sources, the discovered headers and the output of a target and of
+ * the targets it depends on
+ */
+void cbuild_stat_prefetch_collect(cbuild_target *target, unsigned generation,
+        cbuild_stat_prefetch_list *list)
+{
+    for (size_t i = 0; target->sources[i].source_type; i++)
+    {
+        if (target->sources[i].source_type != CBUILD_TARGET_SOURCE)
+            cbuild_stat_prefetch_add(list,
+                                     cbuild_source_file(&target->sources[i]));
+        else if (cbuild_target_visit(target->sources[i].source.target,
+                                     generation))
+            cbuild_stat_prefetch_collect(target->sources[i].source.target,
+                                         generation, list);
+    }
+    cbuild_str_vector *deps = cbuild_get_discovered_deps(target->target_file);
+    for (size_t i = 0; deps != NULL && i < deps->size; i++)
+        cbuild_stat_prefetch_add(list, deps->strs[i]);
+    cbuild_stat_prefetch_add(list, target->target_file);
+}
+
+/**
+ * starts a build with an empty stat cache, filled by cbuild_stat_prefetch_jobs
+ * threads with the files the build depends on when there are enough of them
+ */
+void cbuild_stat_prefetch(cbuild_target *target)
+{
+    if (cbuild_stat_cache_kept)
+        return;
+    cbuild_stat_cache_clear();
+    if (cbuild_stat_prefetch_jobs == 0)
+        return;
+
+    cbuild_stat_prefetch_list list = { 0 };
+    unsigned generation = cbuild_start_traversal();
+    cbuild_target_visit(target, generation);
+    cbuild_stat_prefetch_collect(target, generation, &list);
+    // below a few hundred files per thread, starting the threads costs more
+    // than it saves
+    size_t nb_threads = list.size / 256;
+    if (nb_threads > cbuild_stat_prefetch_jobs)
+        nb_threads = cbuild_stat_prefetch_jobs;
+    if (nb_threads < 2)
+        nb_threads = 1;
+    pthread_t *threads = malloc(nb_threads * sizeof(pthread_t));
+    char *started = calloc(nb_threads, 1);
+    cbuild_stat_prefetch_work *works =
+        malloc(nb_threads * sizeof(cbuild_stat_prefetch_work));
+    for (size_t i = 0; i < nb_threads; i++)
+    {
+        works[i] = (cbuild_stat_prefetch_work){
+            list.entries, list.size, i, nb_threads
+        };
+        started[i] = i > 0 && pthread_create(&threads[i], NULL,
+                                             cbuild_stat_prefetch_thread,
+                                             &works[i]) == 0;
+    }
+    // the share of the first thread, and of those which could not start
+    for (size_t i = 0; i < nb_threads; i++)
+    {
+        if (!started[i])
+            cbuild_stat_prefetch_thread(&works[i]);
+    }
+    for (size_t i = 0; i < nb_threads; i++)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(started);
+    free(works);
+    free(list.entries);
+}
+
+int __cbuild_build_target(cbuild_target *target, int *built,
+        int always_recompile, unsigned generation)
+{
+    int build_needed = always_recompile;
+    int failed = 0;
+    target->changed = 0;
+    target->state = CBUILD_TARGET_WAITING;
+    target->cause.kind = CBUILD_CAUSE_NONE;
+    if (always_recompile)
+        cbuild_target_set_cause(target, CBUILD_CAUSE_ALWAYS_RECOMPILE, NULL);
+
+    for (size_t i = 0; target->sources[i].source_type; i++)
+    {
+        if (cbuild_interrupted)
+            return 1;
+        if (target->sources[i].source_type == CBUILD_TARGET_SOURCE)
+        {
+            cbuild_target *source = target->sources[i].source.target;
+            if (cbuild_target_visit(source, generation))
+                __cbuild_build_target(source, built, always_recompile,
+                                      generation);
+            // the targets which do not depend on it are still built
+            if (source->state != CBUILD_TARGET_DONE)
+            {
+                failed = 1;
+                if (!cbuild_should_keep_going())
+                    return 1;
+                continue;
+            }
+            // with content hashes, the rebuilt sources change the inputs hash
+            if (cbuild_early_cutoff && !cbuild_use_content_hash
+                    && source->changed)
+                build_needed |= cbuild_target_set_cause(target,
+                        CBUILD_CAUSE_REBUILT_SOURCE, source->target_file);
+            else if (!cbuild_use_content_hash && !cbuild_early_cutoff
+                     && *built)
+                build_needed |= cbuild_target_set_cause(target,
+                        CBUILD_CAUSE_EARLIER_BUILD, NULL);
+        }
+    }
+    if (failed || cbuild_interrupted)
+        return 1;
+    double check_start = cbuild_get_time();
+    build_needed |= cbuild_target_needs_rebuild(target);
+    cbuild_trace_span("check", 0, check_start, cbuild_get_time(), NULL);
+    if (*built && !cbuild_use_content_hash && !cbuild_early_cutoff)
+        build_needed |= cbuild_target_set_cause(target,
+                                                CBUILD_CAUSE_EARLIER_BUILD,
+                                                NULL);
+
+    if (build_needed)
+    {
+        cbuild_explain_target(target);
+        cbuild_target_remember_output(target);
+        *built = 1;
+        if (cbuild_cache_restore(target) == 0)
+            cbuild_target_built(target);
+        else
+        {
+            cbuild_job job = { 0 };
+            int error = cbuild_job_start(&job, target);
+            if (!error)
+                cbuild_job_drain(&job);
+            // the command is kept if it finished before the interruption
+            if (!error && cbuild_interrupted)
+            {
+                cbuild_jobs_cancel(&job, 1);
+                return 1;
+            }
+            if (error || cbuild_job_finish(&job) != 0)
+            {
+                cbuild_target_failed(target);
+                return 1;
+            }
+        }
+    }
+    target->state = CBUILD_TARGET_DONE;
+    return 0;
+}
+
+int cbuild_build_target(cbuild_target *target, int *built, int always_recompile)
+{
+    int local_built = 0;
+    if (built == NULL)
+        built = &local_built;
+
+    cbuild_catch_interrupts(1);
+    cbuild_trace_begin();
+    cbuild_stat_cache_used = 1;
+    cbuild_stat_prefetch(target);
+    cbuild_trace_span("stat prefetch", 0, cbuild_trace.start, cbuild_get_time(),
+                      NULL);
+    unsigned generation = cbuild_start_traversal();
+    cbuild_target_visit(target, generation);
+    int error = __cbuild_build_target(target, built, always_recompile,
+                                      generation);
+    cbuild_trace_end(1);
+    cbuild_explain_end();
+    cbuild_report_usage();
+    cbuild_report_failures(0);
+    cbuild_close_deps_log();
+    cbuild_save_fingerprints();
+    cbuild_save_target_records();
+    cbuild_remote_cache_wait();
+    cbuild_cache_trim();
+    cbuild_arena_reset(&cbuild_build_arena);
+    cbuild_stat_cache_used = 0;
+    cbuild_catch_interrupts(0);
+    return error;
+}
+
+/**
+ * starts the build of a target in a job if it needs one. Returns 1 if the job
+ * runs, 0 if the target is built already and -1 on error
+ */
+int cbuild_build_target_async(cbuild_target *target, int *built,
+                              int always_recompile, cbuild_job *job)
+{
+    double check_start = cbuild_get_time();
+    int build_needed = cbuild_target_check(target);
+    cbuild_trace_span("check", 0, check_start, cbuild_get_time(), NULL);
+    if (always_recompile)
+    {
+        target->cause.kind = CBUILD_CAUSE_NONE;
+        build_needed = cbuild_target_set_cause(target,
+                CBUILD_CAUSE_ALWAYS_RECOMPILE, NULL);
+    }
+
+    if (build_needed)
+    {
+        cbuild_explain_target(target);
+        cbuild_target_remember_output(target);
+        *built = 1;
+        if (cbuild_cache_restore(target) != 0)
+            return cbuild_job_start(job, target) == 0 ? 1 : -1;
+        cbuild_target_built(target);
+    }
+    target->is_built = 1;
+    return 0;
+}
+
+void cbuild_target_stack_push(cbuild_target_stack *sk, cbuild_target *target)
+{
+    cbuild_target_stack_item *sti = sk->arena == NULL
+        ? calloc(1, sizeof(cbuild_target_stack_item))
+        : cbuild_arena_alloc(sk->arena, sizeof(cbuild_target_stack_item));
+    sti->target = target;
+    sti->next = sk->head;
+    sk->head = sti;
+}
+
+void cbuild_target_vector_add_target(cbuild_target_vector *vector,
+        cbuild_target *target)
+{
+    if (vector->targets == NULL)
+    {
+        vector->capacity = 4;
+        vector->targets = malloc(vector->capacity * sizeof(cbuild_target *));
+        vector->size = 0;
+    }
+    if (vector->size == vector->capacity)
+    {
+        vector->capacity *= 2;
+        vector->targets = realloc(vector->targets,
+                vector->capacity * sizeof(cbuild_target *));
+    }
+    vector->targets[vector->size++] = target;
+}
+
+void cbuild_target_queue_push(cbuild_target_queue *queue,
+        cbuild_target *target)
+{
+    if (queue->targets == NULL)
+    {
+        queue->capacity = 8;
+        queue->targets = malloc(queue->capacity * sizeof(cbuild_target *));
+        queue->size = 0;
+    }
+    if (queue->size == queue->capacity)
+    {
+        queue->capacity *= 2;
+        queue->targets = realloc(queue->targets,
+                queue->capacity * sizeof(cbuild_target *));
+    }
+    target->state = CBUILD_TARGET_READY;
+
+    size_t i = queue->size++;
+    while (i > 0 && queue->targets[(i - 1) / 2]->priority < target->priority)
+    {
+        queue->targets[i] = queue->targets[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    queue->targets[i] = target;
+}
+
+cbuild_target *cbuild_target_queue_pop(cbuild_target_queue *queue)
+{
+    if (queue->size == 0)
+        return NULL;
+    cbuild_target *res = queue->targets[0];
+    cbuild_target *last = queue->targets[--queue->size];
+
+    size_t i = 0;
+    while (2 * i + 1 < queue->size)
+    {
+        size_t child = 2 * i + 1;
+        if (child + 1 < queue->size && queue->targets[child + 1]->priority
+                > queue->targets[child]->priority)
+            child += 1;
+        if (queue->targets[child]->priority <= last->priority)
+            break;
+        queue->targets[i] = queue->targets[child];
+        i = child;
+    }
+    queue->targets[i] = last;
+    return res;
+}
+
+/**
+ * pushes every target reachable from target exactly once, sources before the
+ * targets depending on them, so that the head of the stack is target itself
+ */
+void __cbuild_setup_target_stack(cbuild_target *target,
+        cbuild_target_stack *res, unsigned generation)
+{
+    for (size_t i = 0; target->sources[i].source_type; i++)
+    {
+        if (target->sources[i].source_type == CBUILD_TARGET_SOURCE
+                && cbuild_target_visit(target->sources[i].source.target,
+                                       generation))
+            __cbuild_setup_target_stack(target->sources[i].source.target, res,
+                                        generation);
+    }
+    cbuild_target_stack_push(res, target);
+}
+
+void cbuild_setup_target_stack(cbuild_target *target,
+        cbuild_target_stack *res)
+{
+    unsigned generation = cbuild_start_traversal();
+    cbuild_target_visit(target, generation);
+    __cbuild_setup_target_stack(target, res, generation);
+}
+
+/**
+ * sets the priority of every target to the sum of the durations along the
+ * longest path from it to the built target. The targets without any recorded
+ * duration are assumed to last as long as the average recorded one, so when
+ * there is no history at all the longest chain of targets comes first
+ */
+void cbuild_setup_priorities(cbuild_target_stack *targets)
+{
+    double total_duration = 0;
+    size_t nb_durations = 0;
+    for (cbuild_target_stack_item *it = targets->head; it; it = it->next)
+    {
+        if (it->target->record->duration > 0)
+        {
+            total_duration += it->target->record->duration;
+            nb_durations += 1;
+        }
+    }
+    double default_duration = nb_durations ? total_duration / nb_durations : 1;
+
+    // targets come before their sources in the stack
+    for (cbuild_target_stack_item *it = targets->head; it; it = it->next)
+    {
+        cbuild_target *current = it->target;
+        double longest = 0;
+        for (size_t i = 0; i < current->dependents.size; i++)
+        {
+            if (current->dependents.targets[i]->priority > longest)
+                longest = current->dependents.targets[i]->priority;
+        }
+        current->priority = longest + (current->record->duration > 0
+                                       ? current->record->duration
+                                       : default_duration);
+    }
+}
+
+/**
+ * computes the reverse edges, the number of unbuilt target sources and the
+ * priority of every target of the stack, and pushes the ones that can be built
+ * right away on the ready queue
+ */
+void cbuild_setup_ready_queue(cbuild_target_stack *targets,
+        cbuild_target_queue *ready)
+{
+    for (cbuild_target_stack_item *it = targets->head; it; it = it->next)
+    {
+        it->target->state = CBUILD_TARGET_IDLE;
+        it->target->is_built = 0;
+        it->target->pending_sources = 0;
+        it->target->changed = 0;
+        it->target->stale = -1;
+        it->target->dependents.size = 0;
+        cbuild_pool *pool = it->target->pool;
+        if (pool != NULL)
+        {
+            pool->running = 0;
+            pool->delayed.size = 0;
+            if (pool->cpu_share > 0)
+                pool->depth = pool->cpu_share * cbuild_available_cpus();
+            if (pool->cpu_share > 0 && pool->depth == 0)
+                pool->depth = 1;
+        }
+        if (it->target->record == NULL)
+            it->target->record = cbuild_get_target_record(
+                    it->target->target_file);
+    }
+    for (cbuild_target_stack_item *it = targets->head; it; it = it->next)
+    {
+        cbuild_target *current = it->target;
+        current->state = CBUILD_TARGET_WAITING;
+        for (size_t i = 0; current->sources[i].source_type; i++)
+        {
+            if (current->sources[i].source_type != CBUILD_TARGET_SOURCE)
+                continue;
+            current->pending_sources += 1;
+            cbuild_target_vector_add_target(
+                    &current->sources[i].source.target->dependents, current);
+        }
+    }
+    cbuild_setup_priorities(targets);
+    for (cbuild_target_stack_item *it = targets->head; it; it = it->next)
+    {
+        if (it->target->state == CBUILD_TARGET_WAITING
+                && it->target->pending_sources == 0)
+        {
+            cbuild_target_queue_push(ready, it->target);
+            cbuild_cache_prefetch(it->target);
+        }
+    }
+}
+
+/**
+ * marks a target as built and pushes the dependents that no longer wait for
+ * any other target on the ready queue
+ */
+void cbuild_target_done(cbuild_target *target, cbuild_target_queue *ready)
+{
+    target->state = CBUILD_TARGET_DONE;
+    target->is_built = 1;
+    for (size_t i = 0; i < target->dependents.size; i++)
+    {
+        cbuild_target *dependent = target->dependents.targets[i];
+        if (--dependent->pending_sources == 0)
+        {
+            cbuild_target_queue_push(ready, dependent);
+            cbuild_cache_prefetch(dependent);
+        }
+    }
+}
+
+/**
+ * finishes a job whose process exited and pushes the targets it unblocks on
+ * the ready queue
+ */
+int cbuild_job_reap(cbuild_job *job, cbuild_target_queue *ready)
+{
+    cbuild_target *target = job->target;
+    cbuild_pool *pool = target->pool;
+    if (pool != NULL)
+    {
+        pool->running -= 1;
+        // the slot of the pool goes to the most urgent of its waiting targets
+        cbuild_target *delayed = cbuild_target_queue_pop(&pool->delayed);
+        if (delayed != NULL)
+            cbuild_target_queue_push(ready, delayed);
+    }
+    if (cbuild_job_finish(job) != 0)
+    {
+        cbuild_target_failed(target);
+        return !cbuild_should_keep_going();
+    }
+    cbuild_target_done(target, ready);
+    return 0;
+}
+
+int cbuild_multiprocess_build_target(cbuild_target *target, int *built,
+        int always_recompile, unsigned nb_process)
+{
+    int local_built = 0;
+    if (built == NULL)
+        built = &local_built;
+
+    if (nb_process == 0)
+        nb_process = cbuild_available_cpus();
+    cbuild_catch_interrupts(1);
+    cbuild_trace_begin();
+    cbuild_stat_cache_used = 1;
+    cbuild_stat_prefetch(target);
+    double setup_start = cbuild_get_time();
+    cbuild_trace_span("stat prefetch", 0, cbuild_trace.start, setup_start,
+                      NULL);
+    // the graph only lasts for the build
+    cbuild_target_stack targets = { NULL, &cbuild_build_arena };
+    cbuild_setup_target_stack(target, &targets);
+    cbuild_target_queue ready = { 0 };
+    cbuild_setup_ready_queue(&targets, &ready);
+    cbuild_trace_span("graph setup", 0, setup_start, cbuild_get_time(), NULL);
+    cbuild_job *jobs = calloc(nb_process, sizeof(cbuild_job));
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    cbuild_jobserver_setup(nb_process);
+    // the jobserver only wakes the loop up when a token is needed
+    struct epoll_event jobserver_event = { .events = 0 };
+    jobserver_event.data.u64 = ~0ULL;
+    if (epoll_fd != -1 && cbuild_jobserver.read_fd != -1)
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cbuild_jobserver.read_fd,
+                  &jobserver_event);
+    // a signal received out of epoll_wait still wakes it up
+    struct epoll_event interrupt_event = { .events = EPOLLIN };
+    interrupt_event.data.u64 = ~1ULL;
+    if (epoll_fd != -1 && cbuild_interrupt_pipe[0] != -1)
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cbuild_interrupt_pipe[0],
+                  &interrupt_event);
+
+    unsigned running_processes = 0;
+    double throttle_start = 0;
+    cbuild_throttled_time = 0;
+    // why slots are left free since idle_start, NULL if they are all used
+    const char *idle_reason = NULL;
+    double idle_start = 0;
+    int error = epoll_fd == -1;
+    while (!error && !cbuild_interrupted)
+    {
+        int throttled = 0;
+        while (running_processes < nb_process && !cbuild_interrupted)
+        {
+            if (ready.size > 0 && running_processes > 0
+                    && cbuild_admission_throttled())
+            {
+                throttled = 1;
+                break;
+            }
+            // each job but the first one needs a token
+            if (ready.size > 0
+                    && cbuild_jobserver.tokens.size < running_processes
+                    && !cbuild_jobserver_acquire())
+            {
+                jobserver_event.events = EPOLLIN | EPOLLONESHOT;
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, cbuild_jobserver.read_fd,
+                          &jobserver_event);
                 break;
-            // TODO: goto
-            pid_t pid = cbuild_build_target_async(to_build, built,
-                                                  always_recompile);
-            if (pid == -1)
+            }
+            cbuild_target *to_build = cbuild_target_queue_pop(&ready);
+            if (to_build == NULL)
                 break;
-            if (pid == 0)
+            cbuild_pool *pool = to_build->pool;
+            if (pool != NULL && pool->depth != 0
+                    && pool->running >= pool->depth)
+            {
+                cbuild_target_queue_push(&pool->delayed, to_build);
+                continue;
+            }
+            size_t slot = 0;
+            while (jobs[slot].target != NULL)
+                slot++;
+            cbuild_job *job = &jobs[slot];
+            job->slot = slot;
+            int status = cbuild_build_target_async(to_build, built,
+                                                   always_recompile, job);
+            if (status == -1)
+            {
+                cbuild_target_failed(to_build);
+                error = !cbuild_should_keep_going();
+                if (error)
+                    break;
                 continue;
+            }
+            if (status == 0)
+            {
+                cbuild_target_done(to_build, &ready);
+                continue;
+            }
+            to_build->state = CBUILD_TARGET_RUNNING;
             running_processes += 1;
-            cbuild_target_map_insert(&map, pid, to_build);
+            if (pool != NULL)
+                pool->running += 1;
+            // the events tell the slot of the job and which of its fds is ready
+            int fds[] = { job->pidfd, job->out_fd, job->err_fd };
+            for (size_t i = 0; i < 3; i++)
+            {
+                struct epoll_event event = { .events = EPOLLIN };
+                event.data.u64 = slot * 3 + i;
+                if (fds[i] != -1)
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &event);
+            }
+        }
+        // the tokens taken for targets which were up to date
+        while (cbuild_jobserver.tokens.size > 0
+                && cbuild_jobserver.tokens.size + 1 > running_processes)
+            cbuild_jobserver_release();
+        if (throttled && throttle_start == 0)
+            throttle_start = cbuild_get_time();
+        else if (!throttled && throttle_start != 0)
+        {
+            cbuild_throttled_time += cbuild_get_time() - throttle_start;
+            throttle_start = 0;
         }
+        const char *reason = NULL;
+        if (running_processes < nb_process && !error && running_processes > 0)
+            reason = throttled ? "throttled"
+                : ready.size > 0 ? "waiting for a token" : "idle";
+        if (reason != idle_reason)
+        {
+            if (idle_reason != NULL)
+                cbuild_trace_span(idle_reason, 0, idle_start, cbuild_get_time(),
+                                  NULL);
+            idle_reason = reason;
+            idle_start = cbuild_get_time();
+        }
+        if (running_processes == 0 || error)
+            break;
 
-        int wstatus;
-        pid_t pid = waitpid(-1, &wstatus, 0);
-        if (pid == -1)
+        // without pidfds, the exits are polled
+        int timeout = -1;
+        for (size_t i = 0; i < nb_process && timeout == -1; i++)
+        {
+            if (jobs[i].target != NULL && jobs[i].pidfd == -1)
+                timeout = 10;
+        }
+        // the load of the host is checked again even if no job finishes
+        if (throttled && timeout == -1)
+            timeout = 500;
+        struct epoll_event events[64];
+        int nb_events = epoll_wait(epoll_fd, events, 64, timeout);
+        if (nb_events == -1 && errno != EINTR)
+        {
+            error = 1;
             break;
-        running_processes -= 1;
-        error = WEXITSTATUS(wstatus);
-        cbuild_target *target = cbuild_target_map_get(&map, pid);
-        target->is_built = 1;
-        cbuild_target_map_remove(&map, pid);
+        }
+        for (int i = 0; i < nb_events; i++)
+        {
+            // a token may be available, it is taken when filling the slots,
+            // and an interruption ends the loop
+            if (events[i].data.u64 == ~0ULL || events[i].data.u64 == ~1ULL)
+                continue;
+            cbuild_job *job = &jobs[events[i].data.u64 / 3];
+            int kind = events[i].data.u64 % 3;
+            // the job may have finished with a previous event
+            if (job->target == NULL)
+                continue;
+            if (kind == 1 && job->out_fd != -1)
+                cbuild_job_read(job, job->out_fd);
+            else if (kind == 2 && job->err_fd != -1)
+                cbuild_job_read(job, job->err_fd);
+            else if (kind == 0)
+            {
+                running_processes -= 1;
+                error |= cbuild_job_reap(job, &ready);
+            }
+        }
+        for (size_t i = 0; timeout != -1 && i < nb_process; i++)
+        {
+            siginfo_t info;
+            memset(&info, 0, sizeof(info));
+            if (jobs[i].target == NULL || jobs[i].pidfd != -1
+                    || waitid(P_PID, jobs[i].pid, &info,
+                              WEXITED | WNOHANG | WNOWAIT) == -1
+                    || info.si_pid == 0)
+                continue;
+            running_processes -= 1;
+            error |= cbuild_job_reap(&jobs[i], &ready);
+        }
     }
-    // TODO: Clean up processes in goto
+    error |= cbuild_interrupted != 0;
+    if (idle_reason != NULL)
+        cbuild_trace_span(idle_reason, 0, idle_start, cbuild_get_time(), NULL);
+    // after a failure, the other commands are stopped at once
+    cbuild_jobs_cancel(jobs, nb_process);
+    cbuild_trace_end(nb_process);
+    cbuild_explain_end();
+    size_t nb_skipped = 0;
+    for (cbuild_target_stack_item *it = targets.head; it; it = it->next)
+        nb_skipped += it->target->state == CBUILD_TARGET_WAITING;
+    error |= cbuild_failed_targets.size > 0;
+    cbuild_report_usage();
+    cbuild_report_failures(cbuild_should_keep_going() ? nb_skipped : 0);
+    free(ready.targets);
+    free(jobs);
+    if (epoll_fd != -1)
+        close(epoll_fd);
+    cbuild_jobserver_cleanup();
+    if (throttle_start != 0)
+        cbuild_throttled_time += cbuild_get_time() - throttle_start;
+    if (cbuild_throttled_time > 0)
+        cbuild_log(CBUILD_INFO, "Throttled by the load of the host for %.1fs",
+                   cbuild_throttled_time);
+    cbuild_close_deps_log();
+    cbuild_save_target_records();
+    cbuild_save_fingerprints();
+    cbuild_remote_cache_wait();
+    cbuild_cache_trim();
+    cbuild_arena_reset(&cbuild_build_arena);
+    cbuild_stat_cache_used = 0;
+    cbuild_catch_interrupts(0);
     return error != 0;
 }
 
+/*** watch impl ***/
+
+unsigned cbuild_watch_debounce_ms = 50;
+
+static struct {
+    int fd; ///< inotify instance
+    cbuild_hash_map dirs; ///< watch descriptor + 2 of each directory, 1 if it cannot be watched
+    cbuild_hash_map files; ///< paths of each `<wd>/<name>', as spelled in the graph
+} cbuild_watch;
+
+/**
+ * watches the directory of a file, remembering how the graph spells it.
+ * Returns true if the file was not watched yet and was modified since the
+ * build stated it, which no event reports
+ */
+int cbuild_watch_file(char *file)
+{
+    const char *slash = strrchr(file, '/');
+    const char *name = slash != NULL ? slash + 1 : file;
+    // the root stays `/'
+    char *dir = slash == NULL ? strdup(".")
+        : strndup(file, slash == file ? 1 : (size_t)(slash - file));
+    size_t wd = (size_t)cbuild_hash_map_get(&cbuild_watch.dirs, dir);
+    if (wd == 0)
+    {
+        int watch = inotify_add_watch(cbuild_watch.fd, dir,
+                IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE
+                | IN_DELETE | IN_ATTRIB);
+        if (watch == -1)
+            cbuild_log(CBUILD_WARN, "Could not watch %s: %s", dir,
+                       strerror(errno));
+        wd = watch + 2;
+        cbuild_hash_map_set(&cbuild_watch.dirs, dir, (void *)wd);
+    }
+    else
+        free(dir);
+    if (wd == 1)
+        return 0;
+
+    char *key = malloc(strlen(name) + 16);
+    sprintf(key, "%zu/%s", wd - 2, name);
+    cbuild_str_vector *paths = cbuild_hash_map_get(&cbuild_watch.files, key);
+    if (paths == NULL)
+    {
+        paths = calloc(1, sizeof(cbuild_str_vector));
+        cbuild_hash_map_set(&cbuild_watch.files, key, paths);
+    }
+    else
+        free(key);
+    for (size_t i = 0; i < paths->size; i++)
+    {
+        if (strcmp(paths->strs[i], file) == 0)
+            return 0;
+    }
+    cbuild_str_vector_add_str(paths, file);
+    return cbuild_stat_refresh(file);
+}
+
+/**
+ * watches the sources and the discovered headers of a target and of the
+ * targets it depends on. The files no longer used stay watched. Returns true
+ * if a file newly watched was modified since the build stated it
+ */
+int cbuild_watch_collect(cbuild_target *target, unsigned generation)
+{
+    int modified = 0;
+    for (size_t i = 0; target->sources[i].source_type; i++)
+    {
+        if (target->sources[i].source_type != CBUILD_TARGET_SOURCE)
+            modified |= cbuild_watch_file(target->sources[i].source.file);
+        else if (cbuild_target_visit(target->sources[i].source.target,
+                                     generation))
+            modified |= cbuild_watch_collect(target->sources[i].source.target,
+                                             generation);
+    }
+    cbuild_str_vector *deps = cbuild_get_discovered_deps(target->target_file);
+    for (size_t i = 0; deps != NULL && i < deps->size; i++)
+        modified |= cbuild_watch_file(deps->strs[i]);
+    return modified;
+}
+
+/**
+ * reads the pending events, invalidating the metadata of the modified files.
+ * Returns true if one of them is watched
+ */
+int cbuild_watch_read(void)
+{
+    union {
+        struct inotify_event event;
+        char bytes[65536];
+    } buffer;
+    int modified = 0;
+    ssize_t size;
+    while ((size = read(cbuild_watch.fd, &buffer, sizeof(buffer))) > 0)
+    {
+        for (char *it = buffer.bytes; it < buffer.bytes + size;)
+        {
+            struct inotify_event *event = (struct inotify_event *)it;
+            it += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                // the modified files are unknown
+                cbuild_stat_cache_clear();
+                modified = 1;
+            }
+            if (event->len == 0)
+                continue;
+            char *key = malloc(strlen(event->name) + 16);
+            sprintf(key, "%d/%s", event->wd, event->name);
+            cbuild_str_vector *paths = cbuild_hash_map_get(&cbuild_watch.files,
+                                                           key);
+            free(key);
+            for (size_t i = 0; paths != NULL && i < paths->size; i++)
+                cbuild_stat_invalidate(paths->strs[i]);
+            modified |= paths != NULL;
+        }
+    }
+    return modified;
+}
+
+int cbuild_watch_target(cbuild_target *target, int always_recompile,
+        unsigned nb_process)
+{
+    cbuild_watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cbuild_watch.fd == -1)
+    {
+        cbuild_log(CBUILD_ERROR, "Could not watch the files: %s",
+                   strerror(errno));
+        return 1;
+    }
+    struct pollfd pollfd = { .fd = cbuild_watch.fd, .events = POLLIN };
+    // the files known before the first build are watched before it states
+    // them, so that none is modified unnoticed
+    unsigned generation = cbuild_start_traversal();
+    cbuild_target_visit(target, generation);
+    cbuild_watch_collect(target, generation);
+    for (;;)
+    {
+        cbuild_multiprocess_build_target(target, NULL, always_recompile,
+                                         nb_process);
+        always_recompile = 0;
+        cbuild_stat_cache_kept = 1;
+        // the headers discovered by the build are watched too, and built
+        // again at once if they were modified since the build stated them
+        generation = cbuild_start_traversal();
+        cbuild_target_visit(target, generation);
+        int modified = cbuild_watch_collect(target, generation);
+        cbuild_log(CBUILD_INFO, "Watching %zu files for changes",
+                   cbuild_watch.files.size);
+        fflush(stdout);
+
+        while (!modified)
+        {
+            if (poll(&pollfd, 1, -1) == -1 && errno != EINTR)
+                return 1;
+            modified = cbuild_watch_read();
+        }
+        // until the editor is done saving
+        while (poll(&pollfd, 1, cbuild_watch_debounce_ms) > 0)
+            cbuild_watch_read();
+    }
+}
+
 int cbuild_write_argument(char *name, char *type, char *default_value,
                           char *args, char *desc)
 {
@@ -882,10 +5395,20 @@ int cbuild_bootstrap_first_step(cbuild_command *build_command)
     remove("cargparse.h.in");
     cbuild_write_argument("clean", "bool", "false", "clean",
                           "clean all generated files");
-    cbuild_write_argument("nb_process", "int", "1", "j",
-                          "number of process that can run simultaneously");
+    cbuild_write_argument("nb_process", "cbuild_jobs", "0", "j",
+                          "number of process that can run simultaneously, "
+                          "auto for the number of CPUs");
     cbuild_write_argument("always_compile", "bool", "false", "B",
                           "recompile every targets");
+    cbuild_write_argument("keep_going", "bool", "false", "k",
+                          "keep building the targets not depending on a "
+                          "failure");
+    cbuild_write_argument("watch", "bool", "false", "watch",
+                          "build again each time a source is modified");
+    cbuild_write_argument("trace", "cstr", "NULL", "trace",
+                          "write a Chrome trace of the build in a file");
+    cbuild_write_argument("explain", "bool", "false", "explain",
+                          "print why each target is rebuilt");
 #ifdef CBUILD_CUSTOM_ARGS
     CBUILD_CUSTOM_ARGS;
 #endif /* CBUILD_CUSTOM_ARGS */
@@ -934,7 +5457,7 @@ int __cbuild_rebuild_yourself(char *cbuild_source, char *cbuild_target, char *ar
 
     cbuild_command build_command = { 0 };
     cbuild_command_add_args(&build_command, "cc", "-Wall", "-Wextra",
-            "-std=c99");
+            "-std=c99", "-D_GNU_SOURCE", "-pthread");
     cbuild_command_add_args(&build_command, "-o", cbuild_target,
             cbuild_source);
 
@@ -46,7 +46,8 @@ int main(int argc, char *argv[])
         return 0;
     }
 
-    if (cbuild_multiprocess_build_target(&_main, NULL, 0, 4))
+    if (cbuild_multiprocess_build_target(&_main, NULL, 0,
+                cbuild_available_cpus()))
     {
         cbuild_log(CBUILD_ERROR, "Could not build target `main'");
         return 1;
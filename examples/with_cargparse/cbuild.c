@@ -33,6 +33,8 @@ int main(int argc, char *argv[])
         cbuild_clean_target(&toto);
         return 0;
     }
+    if (watch)
+        return cbuild_watch_target(&toto, always_compile, nb_process);
     if (cbuild_build_target(&toto, &rebuilt, always_compile))
     {
         cbuild_log(CBUILD_ERROR, "Could not build target %s", toto.target_file);
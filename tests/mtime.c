@@ -0,0 +1,146 @@
+/*
+ * Checks the comparison of modification times to the nanosecond, the
+ * migration of the records and fingerprints written with times in seconds,
+ * and the fingerprints of files modified in the second they were hashed in.
+ *
+ *     cc -o mtime mtime.c && ./mtime
+ *
+ * The files are created in a temporary directory and their times are set
+ * with utimensat. Each check prints a line, `ok' or `FAIL', and the exit
+ * status is the number of failed checks.
+ */
+#define CBUILD_IMPLEMENTATION
+#include "../cbuild.h"
+
+// a time in 2001, in seconds
+#define SECONDS 1000000000LL
+#define NS_PER_SECOND 1000000000LL
+
+static int failures = 0;
+
+static void check(int success, const char *name)
+{
+    printf("%s %s\n", success ? "ok" : "FAIL", name);
+    failures += !success;
+}
+
+static void write_file(const char *file, const char *content)
+{
+    FILE *f = fopen(file, "w");
+    if (f == NULL || fputs(content, f) == EOF || fclose(f) != 0)
+    {
+        fprintf(stderr, "could not write %s\n", file);
+        exit(1);
+    }
+}
+
+static void set_mtime(const char *file, long long seconds, long nanoseconds)
+{
+    struct timespec times[2] = {
+        { .tv_sec = seconds, .tv_nsec = nanoseconds },
+        { .tv_sec = seconds, .tv_nsec = nanoseconds },
+    };
+    if (utimensat(AT_FDCWD, file, times, 0) == -1)
+    {
+        fprintf(stderr, "could not set the times of %s\n", file);
+        exit(1);
+    }
+}
+
+/*
+ * whether the target is out of date, with the given times of the source and
+ * the target
+ */
+static int is_older(long source_ns, long target_ns)
+{
+    set_mtime("source", SECONDS, source_ns);
+    set_mtime("target", SECONDS, target_ns);
+    return cbuild_target_is_older_than_source("target", "source");
+}
+
+static void check_staleness(void)
+{
+    check(is_older(105, 100),
+          "source newer by 5ns within the same second rebuilds");
+    check(!is_older(100, 105),
+          "source older by 5ns within the same second does not rebuild");
+    check(is_older(0, 0), "equal whole-second times rebuild");
+    check(!is_older(500, 500), "equal sub-second times do not rebuild");
+    long long time = SECONDS * NS_PER_SECOND;
+    check(cbuild_mtime_is_newer(time + NS_PER_SECOND, time)
+          && !cbuild_mtime_is_newer(time, time + NS_PER_SECOND),
+          "whole seconds are compared");
+}
+
+static void check_record_migration(void)
+{
+    write_file(".cbuild/targets",
+               "old.o\tcommand=0000000000000001\toutput_mtime=1000000000\n"
+               "new.o\tcommand=0000000000000001"
+               "\toutput_mtime_ns=1000000000000000042\n");
+    cbuild_target_record *old = cbuild_get_target_record("old.o");
+    cbuild_target_record *new = cbuild_get_target_record("new.o");
+    check(old->output_mtime == SECONDS * NS_PER_SECOND,
+          "output_mtime in seconds is converted to nanoseconds");
+    check(new->output_mtime == SECONDS * NS_PER_SECOND + 42,
+          "output_mtime_ns is read as is");
+}
+
+static void check_fingerprint_migration(void)
+{
+    struct stat st;
+    write_file("header.h", "int a;\n");
+    set_mtime("header.h", SECONDS, 0);
+    if (stat("header.h", &st) == -1)
+        exit(1);
+    // the hash does not match the content, only a new hash fixes it
+    FILE *f = fopen(".cbuild/fingerprints", "w");
+    fprintf(f, "header.h\tsize=%lld\tmtime=%lld\tinode=%llu"
+            "\thash=00000000deadbeef\n", (long long)st.st_size,
+            (long long)st.st_mtim.tv_sec, (unsigned long long)st.st_ino);
+    fclose(f);
+    check(cbuild_get_file_hash("header.h") == cbuild_hash_file("header.h"),
+          "fingerprints with mtime in seconds are hashed again");
+}
+
+/*
+ * a file edited in place in the second it was hashed in, on a filesystem with
+ * coarse timestamps, keeps its size and modification time
+ */
+static void check_racy_fingerprint(void)
+{
+    long long now = time(NULL);
+    write_file("racy.h", "int a;\n");
+    set_mtime("racy.h", now, 0);
+    unsigned long long hash = cbuild_get_file_hash("racy.h");
+    write_file("racy.h", "int b;\n");
+    set_mtime("racy.h", now, 0);
+    check(cbuild_get_file_hash("racy.h") != hash,
+          "a file edited in the second it was hashed in is hashed again");
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/cbuild-mtime-XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) == -1
+            || mkdir(cbuild_state_dir, 0755) == -1)
+    {
+        fprintf(stderr, "could not create %s\n", dir);
+        return 1;
+    }
+    write_file("source", "source\n");
+    write_file("target", "target\n");
+
+    check_staleness();
+    check_record_migration();
+    check_fingerprint_migration();
+    check_racy_fingerprint();
+
+    const char *files[] = { "source", "target", "header.h", "racy.h",
+                            ".cbuild/targets", ".cbuild/fingerprints" };
+    for (size_t i = 0; i < sizeof(files) / sizeof(*files); i++)
+        remove(files[i]);
+    rmdir(cbuild_state_dir);
+    rmdir(dir);
+    return failures;
+}